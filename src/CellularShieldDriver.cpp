@@ -20,390 +20,1121 @@
 
 #include "CellularShieldDriver.h"
 
-const CellularShield::NetworkConfig CellularShield::CONFIG_VERIZON = { "vzwinternet", MNOType::VERIZON, PDPType::IPV4};
-const CellularShield::NetworkConfig CellularShield::CONFIG_HOLOGRAM = { "hologram", MNOType::VERIZON, PDPType::IPV4 };
+// Verizon's Cat-M1 network is on bands 4 and 13
+const CellularShield::NetworkConfig CellularShield::CONFIG_VERIZON = { "vzwinternet", MNOType::VERIZON, PDPType::IPV4, (1UL << 3) | (1UL << 12) };
+const CellularShield::NetworkConfig CellularShield::CONFIG_HOLOGRAM = { "hologram", MNOType::VERIZON, PDPType::IPV4, 0 };
+const CellularShield::NetworkConfig CellularShield::CONFIG_AUTO = { nullptr, MNOType::AUTO, PDPType::IPV4, 0 };
+const CellularShield::Policy CellularShield::DEFAULT_POLICY = {
+    LTE_SHIELD_RETRY_TRANSIENT_DELAY,
+    LTE_SHIELD_RETRY_NETWORK_DELAY,
+    LTE_SHIELD_RETRY_MAX_DELAY,
+    LTE_SHIELD_REGISTER_TIMEOUT,
+    LTE_SHIELD_SOCKET_TIMEOUT,
+    LTE_SHIELD_STUCK_THRESHOLD
+};
+// OFF, BOOTING, SEARCHING, IDLE, ACTIVE, PSM, SLEEP, EDRX
+const CellularShield::PowerModel CellularShield::DEFAULT_POWER_MODEL = {
+    { 0, 60000, 80000, 9000, 190000, 8, 1000, 300 },
+    3800
+};
+const CellularShield::Policy CellularShield::POLICY_CAT_M1_EDGE = { 1000, 5000, 30000, 120000, 60000, LTE_SHIELD_STUCK_THRESHOLD };
+const CellularShield::Policy CellularShield::POLICY_NB_IOT = { 2000, 10000, 60000, 180000, 90000, LTE_SHIELD_STUCK_THRESHOLD };
+
+extern const char LTE_SHIELD_FEATURE_CHECK = 0;
 
 CellularShield::CellularShield(HardwareSerial & serial,
     const uint8_t powerDetectPin,
     const uint8_t powerPin,
     const NetworkConfig& netconfig,
     const unsigned int timeout,
-    const CellularShield::DebugLevel level)
+    const CellularShield::DebugLevel level,
+    const char&)
     : m_serial(serial)
     , m_net_config(netconfig)
     , m_power_detect_pin(powerDetectPin)
     , m_power_pin(powerPin)
     , m_timeout(timeout)
-    , m_debug(level) {}
+    , m_debug(level)
+    , m_rx{}
+    , m_rx_head(0)
+    , m_rx_tail(0)
+    , m_rx_scan(0)
+    , m_rx_discard(false)
+    , m_rx_history_full(false)
+    , m_view()
+    , m_line_end(0)
+    , m_echo(EchoState::UNKNOWN)
+    , m_cme_error(-1)
+    , m_pending(nullptr)
+    , m_registration(RegistrationStatus::DISABLED)
+    , m_reject_cause(-1)
+    , m_ccid{}
+    , m_rx_count(0)
+    , m_silent_timeouts(0)
+    , m_recovering(false)
+    , m_policy(DEFAULT_POLICY)
+    , m_stats{}
+    , m_boot_phase(BootPhase::IDLE)
+    , m_boot_error(Error::OK)
+    , m_boot_start(0)
+    , m_boot_phase_start(0)
+    , m_boot_wait(0)
+    , m_boot_reset(false)
+    , m_boot_resume(BootPhase::IDLE)
+    , m_checkpoint{}
+    , m_checkpoint_store(nullptr)
+    , m_power_model(DEFAULT_POWER_MODEL)
+    , m_power_state(PowerState::OFF)
+    , m_power_state_start(0)
+    , m_state_time{}
+    , m_idle(IdleStrategy::NONE)
+    , m_register_time(LTE_SHIELD_REGISTER_ESTIMATE)
+    , m_psm_refused(false)
+    , m_edrx_refused(false)
+    , m_detaching(false)
+    , m_ring_pin(-1)
+    , m_wake_cause(WakeCause::NONE)
+    , m_urc_cause(WakeCause::NONE)
+    , m_errors()
+    , m_journal()
+    , m_recoveries()
+#if LTE_SHIELD_FEATURE_SOCKETS
+    , m_sockets{}
+    , m_hex_mode(false)
+    , m_write_chunk{ LTE_SHIELD_SOCKET_WRITE_MAX / 2, 0, 0 }
+    , m_read_chunk{ LTE_SHIELD_SOCKET_READ_MAX / 2, 0, 0 }
+    , m_nat{}
+    , m_pdp_lost(false)
+    , m_pdp_counted(false)
+    , m_pdp_lost_at(0)
+    , m_pdp_try(0)
+    , m_pdp_wait(0)
+#endif
+#if LTE_SHIELD_FEATURE_SMS
+    , m_new_sms(-1)
+#endif
+    {}
 
-bool CellularShield::begin() {
+bool CellularShield::begin(BootCheckpoint* const checkpoint) {
+    begin_async(checkpoint);
+    while (m_boot_phase != BootPhase::READY && m_boot_phase != BootPhase::FAILED) {
+        poll();
+        LTE_SHIELD_YIELD();
+    }
+    return m_boot_phase == BootPhase::READY;
+}
+
+void CellularShield::begin_async(BootCheckpoint* const checkpoint) {
+    m_boot_start = LTE_SHIELD_MILLIS();
+    m_boot_error = Error::OK;
+    m_boot_reset = false;
+    m_idle = IdleStrategy::NONE;
+    // only an attempt that was cut off while the modem was on is worth resuming,
+    // a finished one is started over as usual
+    m_checkpoint_store = checkpoint;
+    const uint16_t hash = m_config_hash();
+    if (checkpoint != nullptr
+        && checkpoint->magic == LTE_SHIELD_CHECKPOINT_MAGIC
+        && checkpoint->config_hash == hash
+        && checkpoint->phase >= BootPhase::POWER_WAIT
+        && checkpoint->phase < BootPhase::READY) {
+        m_checkpoint = *checkpoint;
+        m_boot_resume = checkpoint->phase;
+    }
+    else {
+        m_checkpoint = { LTE_SHIELD_CHECKPOINT_MAGIC, hash, BootPhase::IDLE, 0, 0 };
+        m_boot_resume = BootPhase::IDLE;
+    }
     // setup pins before we do anything else
     pinMode(m_power_pin, INPUT);
     pinMode(m_power_detect_pin, INPUT_PULLDOWN);
     m_info() << "Begin initialize LTE shield!\n";
+    m_set_power_state(digitalRead(m_power_detect_pin) == HIGH ? m_network_state() : PowerState::OFF);
+#if LTE_SHIELD_FEATURE_SOCKETS
+    m_reset_sockets();
+#endif
     // start the Serial interface
     m_serial.begin(LTE_SHIELD_BAUD);
-    // if the shield is not indicating that it is alive,
-    // and an echo command fails, reconfigure!
-    if (digitalRead(m_power_detect_pin) != HIGH) {
-        Error err = m_send_command("E0", true, nullptr, 0, 200, 3);
-        if (err == Error::TIMEOUT) {
+    m_boot_set_phase(BootPhase::DETECT);
+}
+
+void CellularShield::m_boot_set_phase(const BootPhase phase, const unsigned long wait) {
+    m_info() << "Boot phase: " << get_boot_phase_name(phase) << '\n';
+    m_boot_phase = phase;
+    m_boot_phase_start = LTE_SHIELD_MILLIS();
+    m_boot_wait = wait;
+    m_checkpoint.phase = phase;
+    m_save_checkpoint();
+}
+
+uint16_t CellularShield::m_config_hash() const {
+    // FNV-1a over everything that changes what bring-up does to the modem
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%s,%d,%d,%lu,",
+        m_net_config.apn ? m_net_config.apn : "",
+        static_cast<int>(m_net_config.mno),
+        static_cast<int>(m_net_config.pdp),
+        static_cast<unsigned long>(m_net_config.bands));
+    if (len < 0 || len >= static_cast<int>(sizeof(buf))) len = sizeof(buf) - 1;
+    m_get_config_marker(buf + len, sizeof(buf) - len);
+    uint32_t hash = 2166136261u;
+    for (const char* c = buf; *c != '\0'; c++) hash = (hash ^ static_cast<uint8_t>(*c)) * 16777619u;
+    return static_cast<uint16_t>(hash ^ (hash >> 16));
+}
+
+CellularShield::Error CellularShield::m_boot_finish(const Error err) {
+    m_boot_error = err;
+    m_boot_set_phase(err == Error::OK ? BootPhase::READY : BootPhase::FAILED);
+    m_stats.boots++;
+    if (err != Error::OK) m_stats.boot_failures++;
+    m_stats.boot_time = LTE_SHIELD_MILLIS() - m_boot_start;
+    if (err == Error::OK) m_info() << "LTE Shield is connected and ready!\n";
+    return err;
+}
+
+void CellularShield::m_boot_step() {
+    const unsigned long elapsed = LTE_SHIELD_MILLIS() - m_boot_phase_start;
+    if (elapsed < m_boot_wait) return;
+    switch (m_boot_phase) {
+        case BootPhase::DETECT: {
+            if (m_boot_resume != BootPhase::IDLE) {
+                // the modem is still going from the last attempt, so don't reset it again
+                if (digitalRead(m_power_detect_pin) == HIGH) {
+                    m_info() << "Resuming from boot phase " << get_boot_phase_name(m_boot_resume) << '\n';
+                    m_boot_set_phase(BootPhase::STARTUP);
+                    return;
+                }
+                m_boot_resume = BootPhase::IDLE;
+            }
+            if (digitalRead(m_power_detect_pin) == HIGH) {
+                // the shield is on, so we just need to restart it and clear the NVM
+                m_info() << "Reseting to close all sockets...\n";
+                m_boot_reset = true;
+                const Error err = m_send_command("+CFUN=15", true, nullptr, 0, LTE_SHIELD_RESET_TIMEOUT);
+                if (err == Error::OK) {
+                    m_set_power_state(PowerState::BOOTING);
+#if LTE_SHIELD_FEATURE_SOCKETS
+                    m_reset_sockets();
+#endif
+                    // wait for the device to signal that it's on and ready for input
+                    m_boot_set_phase(BootPhase::POWER_WAIT, 300);
+                }
+                // a modem that doesn't respond to the reset is stuck, so power cycle it instead
+                // (the stuck detector may already have done this for us)
+                else if (err == Error::LTE_RECOVERED || (err == Error::TIMEOUT && m_recover() == Error::OK))
+                    m_boot_set_phase(BootPhase::SIM);
+                else m_boot_finish(err);
+                return;
+            }
+            // if the shield is not indicating that it is alive, and an echo command fails, power it on
+            const Error err = m_disable_echo(200, 1);
+            if (err != Error::TIMEOUT) {
+                m_error() << "Shield answered without indicating power\n";
+                m_boot_finish(err == Error::OK ? Error::UNEXPECTED_OK : err);
+                return;
+            }
             m_info() << "Attempting to power on shield...\n";
-            m_power_toggle();
-            err = m_wait_power_on();
-            if (err != Error::OK) return false;
-            // test shield connectivity
-            if (m_send_command("E0") != Error::OK) return false;
-            delay(1000);
+            pinMode(m_power_pin, OUTPUT);
+            digitalWrite(m_power_pin, LOW);
+            m_boot_set_phase(BootPhase::POWER_PULSE, LTE_SHIELD_POWER_PULSE_PERIOD);
+            return;
         }
-        else return false;
-    }
-    // else we just need to restart it and clear the NVM
-    else {
-        m_info() << "Reseting to close all sockets...\n";
-        Error err = m_reset();
-        if (err != Error::OK) return false;
-    }
-    m_info() << "Shield is online!\n";
-    // Test that the network is configured correctly
-    Error err = m_verify_network();
-    // configure the network
-    if (err == Error::LTE_BAD_CONFIG) {
-        err = m_configure_network();
-        if (err != Error::OK) return false;
-        // verify the network one last time
-        err = m_verify_network();
-        if (err != Error::OK) return false;
+        case BootPhase::POWER_PULSE:
+            pinMode(m_power_pin, INPUT); // Return to high-impedance, rely on SARA module internal pull-up
+            m_set_power_state(PowerState::BOOTING);
+            m_boot_set_phase(BootPhase::POWER_WAIT);
+            return;
+        case BootPhase::POWER_WAIT:
+            if (digitalRead(m_power_detect_pin) == HIGH) {
+                // wait for the device to load the SIM card and other data
+                m_boot_set_phase(BootPhase::STARTUP, 300);
+                return;
+            }
+            if (elapsed - m_boot_wait > LTE_SHIELD_POWER_TIMEOUT) {
+                m_warn() << "Shield did not indicate power on! Reconfiguring...\n";
+                const Error err = m_configure();
+                if (err == Error::OK) m_boot_set_phase(BootPhase::STARTUP);
+                else m_boot_finish(err);
+            }
+            return;
+        case BootPhase::STARTUP: {
+            // one try each step, the modem can take a while to answer after starting
+            Error err = m_disable_echo(m_boot_reset ? LTE_SHIELD_RESET_TIMEOUT : 0, 1);
+            if (err == Error::OK) {
+                // and report errors with numeric codes, so they can be recorded
+                err = m_send_command("+CMEE=1");
+                if (err != Error::OK) {
+                    m_boot_finish(err);
+                    return;
+                }
+                m_set_power_state(m_network_state());
+                m_info() << "Shield is online!\n";
+                m_boot_set_phase(BootPhase::SIM, m_boot_reset ? 0 : 1000);
+            }
+            else if (err == Error::LTE_RECOVERED) m_boot_set_phase(BootPhase::SIM);
+            else if (err != Error::TIMEOUT) m_boot_finish(err);
+            else if (elapsed - m_boot_wait > LTE_SHIELD_RESET_TIMEOUT) {
+                // a modem that doesn't come back after a reset is stuck, so power cycle it
+                if (m_boot_reset && m_recover() == Error::OK) m_boot_set_phase(BootPhase::SIM);
+                else m_boot_finish(err);
+            }
+            return;
+        }
+        case BootPhase::SIM: {
+            // without a working SIM there's no point in going on, so find out now
+            const Error err = m_check_sim();
+            if (err == Error::OK) {
+                // pick the carrier settings before anything is written to the modem
+                if (m_net_config.mno == MNOType::AUTO) m_select_carrier();
+                // skip the steps an interrupted attempt already finished
+                if (m_boot_resume > BootPhase::CONFIGURE) m_boot_set_phase(m_boot_resume);
+                else m_boot_set_phase(BootPhase::CONFIGURE);
+                m_boot_resume = BootPhase::IDLE;
+            }
+            // a busy SIM is still loading, so give it a moment
+            else if (err == Error::LTE_ERROR && m_cme_error == 14 && elapsed < LTE_SHIELD_SIM_TIMEOUT)
+                m_boot_wait = elapsed + 500;
+            else if (err == Error::LTE_SIM_FAILED) {
+                m_record_error("+CPIN?", err, m_boot_phase_start);
+                m_boot_finish(err);
+            }
+            // the modem was power cycled under us, so start talking to it again
+            else if (err == Error::LTE_RECOVERED) m_boot_set_phase(BootPhase::STARTUP);
+            else m_boot_finish(err);
+            return;
+        }
+        case BootPhase::CONFIGURE: {
+            // make sure the modem has our settings, which only needs doing once
+            const Error err = m_check_config();
+            if (err == Error::OK) m_boot_set_phase(BootPhase::NETWORK);
+            else m_boot_finish(err);
+            return;
+        }
+        case BootPhase::NETWORK: {
+            Error err;
+            if (m_checkpoint.network_step > 0 && m_checkpoint.network_step < LTE_SHIELD_NETWORK_STEPS) {
+                // finish a configuration that was interrupted, and check it next step
+                err = m_configure_network();
+                if (err == Error::OK) return;
+            }
+            else {
+                // Test that the network is configured correctly
+                err = m_check_mno();
+                // configure the network, and check it again next step
+                if (err == Error::LTE_BAD_CONFIG && m_checkpoint.network_attempts == 0) {
+                    m_checkpoint.network_attempts++;
+                    m_checkpoint.network_step = 0;
+                    m_save_checkpoint();
+                    err = m_configure_network();
+                    if (err == Error::OK) return;
+                }
+            }
+            if (err == Error::OK) {
+                // have the modem report why the network turns us away, if it does
+                m_reject_cause = -1;
+                m_send_command("+CEREG=3", true, nullptr, 0, 0, 1);
+#if LTE_SHIELD_FEATURE_SOCKETS
+                // and report the data context going away under the sockets (+CGEV)
+                m_send_command("+CGEREP=2,1", true, nullptr, 0, 0, 1);
+#endif
+                m_info() << "Checking registration...\n";
+                m_boot_set_phase(BootPhase::REGISTER);
+            }
+            else m_boot_finish(err);
+            return;
+        }
+        case BootPhase::REGISTER: {
+            const Error err = m_check_registration();
+            if (err != Error::OK) m_boot_finish(err);
+            else if (m_network_state() == PowerState::IDLE) {
+                m_info() << "LTE registered: " << m_get_reg_dbg_str(m_registration) << '\n';
+                m_register_time = elapsed;
+                m_boot_finish(Error::OK);
+            }
+            else if (m_registration == RegistrationStatus::DENIED) {
+                // waiting won't change the network's mind
+                m_error() << "LTE registration denied, cause " << m_reject_cause << '\n';
+                m_record_error("+CEREG?", Error::LTE_REGISTRATION_DENIED, m_boot_phase_start);
+                m_boot_finish(Error::LTE_REGISTRATION_DENIED);
+            }
+            else if (elapsed >= m_policy.register_timeout) {
+                m_error() << "LTE not registered: " << m_get_reg_dbg_str(m_registration) << '\n';
+                m_record_error("+CEREG?", Error::LTE_REGISTRATION_FAILED, m_boot_phase_start);
+                m_boot_finish(Error::LTE_REGISTRATION_FAILED);
+            }
+            // check again in a bit
+            else m_boot_wait = elapsed + 500;
+            return;
+        }
+        default:
+            return;
     }
-    else return false;
-    m_info() << "LTE Shield is connected and ready!\n";
-    return true;
 }
 
 void CellularShield::m_power_toggle() const {
     pinMode(m_power_pin, OUTPUT);
     digitalWrite(m_power_pin, LOW);
-    delay(LTE_SHIELD_POWER_PULSE_PERIOD);
+    LTE_SHIELD_DELAY(LTE_SHIELD_POWER_PULSE_PERIOD);
     pinMode(m_power_pin, INPUT); // Return to high-impedance, rely on SARA module internal pull-up
 }
 
-CellularShield::Error CellularShield::m_wait_power_on() const {
-    // wait for the power indicator pin to go high
-    const unsigned long start = millis();
-    while (digitalRead(m_power_detect_pin) != HIGH) {
+void CellularShield::m_set_power_state(const PowerState state) {
+    // charge the time so far to the state we're leaving
+    const unsigned long now = LTE_SHIELD_MILLIS();
+    m_state_time[static_cast<uint8_t>(m_power_state)] += now - m_power_state_start;
+    m_power_state_start = now;
+    m_power_state = state;
+    // a modem that is starting up has to register again
+    if (state == PowerState::OFF || state == PowerState::BOOTING) m_registration = RegistrationStatus::DISABLED;
+}
+
+CellularShield::PowerState CellularShield::m_network_state() const {
+    return m_registration == RegistrationStatus::HOME_NETWORK || m_registration == RegistrationStatus::ROAMING
+        ? PowerState::IDLE : PowerState::SEARCHING;
+}
+
+uint64_t CellularShield::get_state_time(const PowerState state) const {
+    uint64_t time = m_state_time[static_cast<uint8_t>(state)];
+    if (state == m_power_state) time += LTE_SHIELD_MILLIS() - m_power_state_start;
+    return time;
+}
+
+uint64_t CellularShield::get_energy() const {
+    // ms * uA * mV is in picojoules
+    uint64_t energy = 0;
+    for (uint8_t i = 0; i < LTE_SHIELD_POWER_STATE_COUNT; i++)
+        energy += get_state_time(static_cast<PowerState>(i)) * m_power_model.current[i];
+    return energy * m_power_model.supply_mv / 1000000000ull;
+}
+
+bool CellularShield::m_wait_power(const bool on, const unsigned long timeout) const {
+    // wait for the power indicator pin to reach the requested state
+    const unsigned long start = LTE_SHIELD_MILLIS();
+    while ((digitalRead(m_power_detect_pin) == HIGH) != on) {
         // check timeout
-        if (millis() - start > LTE_SHIELD_POWER_TIMEOUT) {
-            m_warn() << "Shield did not indicate power on! Reconfiguring...\n";
-            Error err = m_configure();
-            if (err != Error::OK) return err;
-            break;
-        }
+        if (LTE_SHIELD_MILLIS() - start > timeout) return false;
+        LTE_SHIELD_YIELD();
+    }
+    return true;
+}
+
+CellularShield::Error CellularShield::m_wait_power_on() {
+    if (!m_wait_power(true, LTE_SHIELD_POWER_TIMEOUT)) {
+        m_warn() << "Shield did not indicate power on! Reconfiguring...\n";
+        Error err = m_configure();
+        if (err != Error::OK) return err;
     }
     return Error::OK;
 }
 
-CellularShield::Error CellularShield::m_reset() const {
+CellularShield::Error CellularShield::m_recover() {
+    m_recovering = true;
+    // try a regular power cycle first, then force the modem off if that doesn't work
+    Error err = m_recover_step(RecoveryLevel::POWER_CYCLE);
+    if (err != Error::OK) err = m_recover_step(RecoveryLevel::HARD_RESET);
+    m_recovering = false;
+    m_silent_timeouts = 0;
+    if (err != Error::OK) m_error() << "Could not recover LTE shield\n";
+    return err;
+}
+
+CellularShield::Error CellularShield::m_recover_step(const RecoveryLevel level) {
+    const unsigned long start = LTE_SHIELD_MILLIS();
+    m_info() << "Recovery step: " << static_cast<uint8_t>(level) << '\n';
+    // switch the modem off
+    if (level == RecoveryLevel::POWER_CYCLE) m_power_toggle();
+    else {
+        pinMode(m_power_pin, OUTPUT);
+        digitalWrite(m_power_pin, LOW);
+        LTE_SHIELD_DELAY(LTE_SHIELD_RESET_PULSE_PERIOD);
+        pinMode(m_power_pin, INPUT);
+    }
+    Error err = Error::TIMEOUT;
+#if LTE_SHIELD_FEATURE_SOCKETS
+    m_reset_sockets();
+#endif
+    if (m_wait_power(false, LTE_SHIELD_POWER_TIMEOUT)) {
+        m_set_power_state(PowerState::OFF);
+        // and back on again
+        m_power_toggle();
+        m_set_power_state(PowerState::BOOTING);
+        if (m_wait_power(true, LTE_SHIELD_POWER_TIMEOUT)) {
+            // wait for the device to load the SIM card and other data
+            LTE_SHIELD_DELAY(300);
+            err = m_disable_echo(0, 3);
+            if (err == Error::OK) err = m_send_command("+CMEE=1");
+            if (err == Error::OK) m_set_power_state(m_network_state());
+        }
+    }
+    RecoveryRecord& rec = m_recoveries.push();
+    rec.level = level;
+    rec.result = err;
+    rec.start = start;
+    rec.duration = LTE_SHIELD_MILLIS() - start;
+    return err;
+}
+
+CellularShield::Error CellularShield::m_reset() {
     // Send the reset command to the device for a clean slate
     Error err = m_send_command("+CFUN=15", true, nullptr, 0, LTE_SHIELD_RESET_TIMEOUT);
     if (err != Error::OK) return err;
+    m_set_power_state(PowerState::BOOTING);
+#if LTE_SHIELD_FEATURE_SOCKETS
+    m_reset_sockets();
+#endif
     // wait for the device to signal that it's on and ready for input
-    delay(300);
+    LTE_SHIELD_DELAY(300);
     err = m_wait_power_on();
     if (err != Error::OK) return err;
     // wait for the device to load the SIM card and other data
-    delay(300);
+    LTE_SHIELD_DELAY(300);
     // we can expect this command to time out, as the data sheet says it may take up to 3min to execute
     // now we have to turn echo off so the device doesn't start jamming us
-    return m_send_command("E0", true, nullptr, 0, LTE_SHIELD_RESET_TIMEOUT);
+    err = m_disable_echo(LTE_SHIELD_RESET_TIMEOUT);
+    if (err != Error::OK) return err;
+    // and report errors with numeric codes, so they can be recorded
+    err = m_send_command("+CMEE=1");
+    if (err == Error::OK) m_set_power_state(m_network_state());
+    return err;
 }
 
-CellularShield::Error CellularShield::m_configure() const {
+CellularShield::Error CellularShield::m_configure() {
     // toggle the power and send test commands until we get something back
+    const unsigned long start = LTE_SHIELD_MILLIS();
     uint8_t tries = 0;
-    Error err = m_send_command("E0");
+    Error err = m_disable_echo();
     while(err != Error::OK && ++tries < 4){
         m_power_toggle();
-        delay(LTE_SHIELD_POWER_TIMEOUT);
-        err = m_send_command("E0");
+        m_set_power_state(PowerState::BOOTING);
+        LTE_SHIELD_DELAY(LTE_SHIELD_POWER_TIMEOUT);
+        err = m_disable_echo();
     }
     if (err != Error::OK) {
         m_error() << "Could not find LTE shield\n";
+        m_record_error("E0", Error::LTE_NOT_FOUND, start);
         return Error::LTE_NOT_FOUND;
     }
+    // the power indicator isn't working, so the settings must be missing
+    return m_apply_config();
+}
+
+CellularShield::Error CellularShield::m_check_config() {
+    // the modem stores a marker file once it has been configured, so we
+    // only need to configure it again if the marker is missing or outdated
+    char marker[8];
+    m_get_config_marker(marker, sizeof(marker));
+    char res[32] = {};
+    // +URDFILE: "<name>",<size>,"<data>"
+    if (m_send_command("+URDFILE=\"lteshld.cfg\"", true, res, sizeof(res), 0, 1) == Error::OK) {
+        char* end = strrchr(res, '"');
+        if (end != nullptr) {
+            *end = '\0';
+            const char* data = strrchr(res, '"');
+            if (data != nullptr && strcmp(data + 1, marker) == 0) return Error::OK;
+        }
+    }
+    m_info() << "Modem configuration is missing or outdated\n";
+    return m_apply_config();
+}
+
+CellularShield::Error CellularShield::m_apply_config() {
     // configure the modem!
     constexpr const char* const commands[] = {
         // set GPIO1 to Network Indicator 
         "+UGPIOC=16,2",
+#if LTE_SHIELD_FEATURE_GNSS
         // GPIO2 to GNSS supply enable
         "+UGPIOC=23,3",
+#endif
         // and GPIO3 as a power indicator
         "+UGPIOC=24,10",
+#if LTE_SHIELD_FEATURE_SMS
         // set SMS message format to TXT,
         "+CMGF=1",
+#endif
         // set auto timezone to true
         "+CTZU=1",
+        // report errors with numeric codes
+        "+CMEE=1",
+        // and save the profile settings (echo, errors, SMS format) to NVM
+        "&W",
     };
+    Error err;
     // run all the above commands in consecutive order
     for (uint8_t i = 0; i < sizeof(commands) / sizeof(char*); i++) {
         err = m_send_command(commands[i]);
         if (err != Error::OK) return err;
-        delay(100);
+        LTE_SHIELD_DELAY(100);
     }
-    // and reset the device
-    err = m_reset();
-    return err;
+    // write the marker last, so a failure part way through is retried next time
+    char marker[8];
+    m_get_config_marker(marker, sizeof(marker));
+    m_send_command("+UDELFILE=\"lteshld.cfg\"", true, nullptr, 0, 0, 1);
+    {
+        char command[32];
+        snprintf(command, sizeof(command), "+UDWNFILE=\"lteshld.cfg\",%u", static_cast<unsigned int>(strlen(marker)));
+        const unsigned long start = LTE_SHIELD_MILLIS();
+        const uint16_t rx_start = m_rx_count;
+        m_cme_error = -1;
+        m_pending = command;
+        err = m_write_command(command);
+        if (err == Error::OK) err = m_wait_prompt('>', start);
+        if (err == Error::OK) {
+            m_write(reinterpret_cast<const uint8_t*>(marker), strlen(marker));
+            m_serial.flush();
+            err = m_read_response(command, nullptr, 0, start, m_timeout);
+        }
+        err = m_finish_command(command, err, start, rx_start);
+        if (err != Error::OK) return err;
+    }
+    m_info() << "Saved modem configuration " << marker << '\n';
+    // and reset the device, as the GPIO settings only apply after a reboot
+    return m_reset();
 }
 
-CellularShield::Error CellularShield::m_configure_network() const {
+void CellularShield::m_get_config_marker(char* const dest, const size_t dest_max) {
+    // the features change which settings are applied, so they are part of the marker
+    const int features = (Features::SMS ? 1 : 0) | (Features::GNSS ? 2 : 0);
+    snprintf(dest, dest_max, "%d.%d", LTE_SHIELD_CONFIG_VERSION, features);
+}
+
+bool CellularShield::set_network_config(const NetworkConfig& config) {
+    m_net_config = config;
+    if (m_boot_phase != BootPhase::READY) return true;
+    // the modem is already up, so bring it in line now. It registers again in the background.
+    if (m_net_config.mno == MNOType::AUTO) m_select_carrier();
+    Error err = m_check_mno();
+    if (err == Error::LTE_BAD_CONFIG) {
+        m_checkpoint.network_step = 0;
+        m_detaching = true;
+        err = m_configure_network();
+        m_detaching = false;
+    }
+    return err == Error::OK;
+}
+
+CellularShield::Error CellularShield::m_configure_network() {
     // this function assumes the device is on configured using m_configure
-    // first we need to set the MNO profile of the device, so that we know
-    // which networks to scan for
-    // disable the network so we can start
-    Error err = m_send_command("+CFUN=0");
-    if (err != Error::OK) return err;
-    // this takes awhile for some reason
-    delay(1000);
-    // set the MNO profile according to what was provided
-    {
-        char buf[16];
-        snprintf(buf, sizeof(buf), "+UMNOPROF=%d", static_cast<int>(m_net_config.mno));
-        err = m_send_command(buf);
+    // each step is checkpointed once its reset is done, so an interrupted
+    // configuration picks up where it stopped instead of starting over
+    Error err;
+    if (m_checkpoint.network_step < 1) {
+        // first we need to set the MNO profile of the device, so that we know
+        // which networks to scan for
+        // disable the network so we can start
+        err = m_send_command("+CFUN=0");
         if (err != Error::OK) return err;
+        // this takes awhile for some reason
+        LTE_SHIELD_DELAY(1000);
+        // set the MNO profile according to what was provided
+        {
+            char buf[16];
+            snprintf(buf, sizeof(buf), "+UMNOPROF=%d", static_cast<int>(m_net_config.mno));
+            err = m_send_command(buf);
+            if (err != Error::OK) return err;
+        }
+        // and reset the device
+        err = m_reset();
+        if (err != Error::OK) return err;
+        // delay extra long here since changing the MNO profile can make the device unstable
+        LTE_SHIELD_DELAY(1000);
+        // if the MNO was auto-selected, make sure that a profile was chosen
+        if (m_net_config.mno == MNOType::AUTO) {
+            char res[3] = {};
+            err = m_send_command("+UMNOPROF?", true, res, 2);
+            if (err != Error::OK) return err;
+            const int num = atoi(res);
+            if (num <= 0) {
+                m_error() << "SIM MNO select failed! This is probably because your SIM is not from a major carrier. Please select an MNO profile other than AUTO.\n";
+                m_record_error("+UMNOPROF?", Error::LTE_AUTO_MNO_FAILED, LTE_SHIELD_MILLIS());
+                return Error::LTE_AUTO_MNO_FAILED;
+            }
+            else
+                m_info() << "SIM autoselect found profile: " << num << '\n';
+            LTE_SHIELD_DELAY(1000);
+        }
+        m_checkpoint.network_step = 1;
+        m_save_checkpoint();
     }
-    // and reset the device
-    err = m_reset();
-    if (err != Error::OK) return err;
-    // delay extra long here since changing the MNO profile can make the device unstable
-    delay(1000);
-    // if the MNO was auto-selected, make sure that a profile was chosen
-    if (m_net_config.mno == MNOType::AUTO) {
-        char res[3] = {};
-        err = m_send_command("+UMNOPROF?", true, res, 2);
+    if (m_checkpoint.network_step < 2) {
+        // next, set the default PDP context with the values provided, if any
+        if (m_net_config.pdp != PDPType::NONE && m_net_config.apn) {
+            // build the AT command
+            char buf[84];
+            snprintf(buf, sizeof(buf), "+CGDCONT=1,\"%s\",\"%s\"", 
+                m_get_pdp_str(m_net_config.pdp), 
+                m_net_config.apn);
+            // configure the PDP contexts
+            err = m_send_command(buf);
+            if (err != Error::OK) return err;
+            LTE_SHIELD_DELAY(500);
+        }
+        // restrict the bands to the carrier's, which makes searching much quicker. This has to
+        // come after the reset that applied the MNO profile, as that puts back the profile's bands.
+        if (m_net_config.bands != 0) {
+            char buf[24];
+            snprintf(buf, sizeof(buf), "+UBANDMASK=0,%lu", static_cast<unsigned long>(m_net_config.bands));
+            err = m_send_command(buf);
+            if (err != Error::OK) return err;
+        }
+        // and reset the device
+        err = m_reset();
         if (err != Error::OK) return err;
-        const int num = atoi(res);
-        if (num <= 0) {
-            m_error() << "SIM MNO select failed! This is probably because your SIM is not from a major carrier. Please select an MNO profile other than AUTO.\n";
-            return Error::LTE_AUTO_MNO_FAILED;
-        }
-        else
-            m_info() << "SIM autoselect found profile: " << num << '\n';
-        delay(1000);
-    }
-    // next, set the default PDP context with the values provided, if any
-    if (m_net_config.pdp != PDPType::NONE && m_net_config.apn) {
-        // build the AT command
-        char buf[84];
-        snprintf(buf, sizeof(buf), "+CGDCONT=1,\"%s\",\"%s\"", 
-            m_get_pdp_str(m_net_config.pdp), 
-            m_net_config.apn);
-        // configure the PDP contexts
-        err = m_send_command(buf);
+        LTE_SHIELD_DELAY(1000);
+        // make sure the bands survived the reset
+        err = m_check_bands();
         if (err != Error::OK) return err;
-        delay(500);
+        m_checkpoint.network_step = 2;
+        m_save_checkpoint();
     }
-    // and reset the device
-    err = m_reset();
-    if (err != Error::OK) return err;
-    delay(1000);
     // finally, set the device to auto-register
     err = m_send_command("+COPS=0");
-    return err;
+    if (err != Error::OK) return err;
+    m_checkpoint.network_step = LTE_SHIELD_NETWORK_STEPS;
+    m_save_checkpoint();
+    return Error::OK;
 }
 
-CellularShield::Error CellularShield::m_verify_network() const {
+CellularShield::Error CellularShield::m_check_mno() {
     // check that the MNO profile is set correctly, as if it isn't
     // we might end up on the wrong networks
-    {
-        char res[3] = {};
-        Error err = m_send_command("+UMNOPROF?", true, res, 2);
-        if (err != Error::OK) return err;
-        const int num = atoi(res);
-        if (num == static_cast<int>(MNOType::ERROR) 
-            || num != static_cast<int>(m_net_config.mno)) {
-                m_warn() << "Found an incorrect MNO on the modem: " << num << '\n';
-                return Error::LTE_BAD_CONFIG;
-            }
+    char res[3] = {};
+    Error err = m_send_command("+UMNOPROF?", true, res, 2);
+    if (err != Error::OK) return err;
+    const int num = atoi(res);
+    if (num == static_cast<int>(MNOType::ERROR) 
+        || num != static_cast<int>(m_net_config.mno)) {
+            m_warn() << "Found an incorrect MNO on the modem: " << num << '\n';
+            return Error::LTE_BAD_CONFIG;
+        }
+    // applying an MNO profile puts the bands back to its defaults, so check ours are still there
+    return m_check_bands();
+}
+
+CellularShield::Error CellularShield::m_check_bands() {
+    if (m_net_config.bands == 0) return Error::OK;
+    // +UBANDMASK: 0,<Cat-M1 mask>[,<mask2>],1,<NB-IoT mask>[,<mask2>], we only set Cat-M1
+    char bands[48] = {};
+    const Error err = m_send_command("+UBANDMASK?", true, bands, sizeof(bands) - 1);
+    if (err != Error::OK) return err;
+    char* end = nullptr;
+    const unsigned long long mask = bands[0] == '0' && bands[1] == ',' ? strtoull(bands + 2, &end, 10) : 0;
+    if (end == nullptr || end == bands + 2 || mask != m_net_config.bands) {
+        m_warn() << "Found incorrect bands on the modem: " << bands << '\n';
+        return Error::LTE_BAD_CONFIG;
     }
-    // check that the network is enables and registered successfully
-    {
-        char res[8];
-        // wait for the registration to finish
-        RegistrationStatus status;
-        uint8_t count = 0;
-        m_info() << "Checking registration...\n";
-        do {
-            // network registration check
-            Error err = m_send_command("+CREG?", true, res, 6);
-            if (err != Error::OK) return err;
-            // check the regisration code against the possible ones
-            status = static_cast<RegistrationStatus>(res[2]);
-            // if the device has registered, or we time out waiting for it
-            if (status == RegistrationStatus::HOME_NETWORK
-                || status == RegistrationStatus::ROAMING
-                || ++count >= LTE_SHIELD_REGISTER_TIMEOUT / 500) break;
-            else delay(500);
-        } while (true);
-        // check the status
-        if (status == RegistrationStatus::HOME_NETWORK
-            || status == RegistrationStatus::ROAMING) {
-            m_info() << "LTE registered: " << m_get_reg_dbg_str(status) << '\n';
-        }
-        else {
-            m_error() << "LTE not registered: " << m_get_reg_dbg_str(status) << '\n';
-            return Error::LTE_REGISTRATION_FAILED;
-        }
-    }
-    // we're good to go!
     return Error::OK;
 }
 
-// unhandled edge cases: "\r\n" in response, response without + prefix, command without + prefix
+CellularShield::Error CellularShield::m_check_sim() {
+    // +CPIN: READY, anything else is waiting on a PIN or PUK. A missing SIM is a CME ERROR.
+    char res[16] = {};
+    Error err = m_send_command("+CPIN?", true, res, sizeof(res), 0, 1);
+    // no SIM, a locked SIM or a broken one (+CME ERROR 10-13, 15, 16) won't fix itself
+    if (err == Error::LTE_ERROR && m_cme_error >= 10 && m_cme_error <= 16
+        && get_retry_class(m_cme_error) == RetryClass::PERMANENT) return Error::LTE_SIM_FAILED;
+    if (err != Error::OK) return err;
+    if (strcmp(res, "READY") != 0) {
+        m_error() << "SIM is not ready: " << res << '\n';
+        return Error::LTE_SIM_FAILED;
+    }
+    // +CCID: <ICCID>
+    err = m_send_command("+CCID", true, m_ccid, sizeof(m_ccid), 0, 1);
+    if (err != Error::OK) return err;
+    m_info() << "SIM ready, ICCID " << m_ccid << '\n';
+    return Error::OK;
+}
+
+void CellularShield::m_select_carrier() {
+    // the ICCID was read with the SIM check, the IMSI is only needed if that doesn't match
+    const NetworkConfig* config = find_carrier(m_ccid, nullptr);
+    if (config == nullptr) {
+        char imsi[16] = {};
+        if (m_send_command("+CIMI", true, imsi, sizeof(imsi), 0, 1) == Error::OK)
+            config = find_carrier(nullptr, imsi);
+    }
+    if (config == nullptr) {
+        m_warn() << "Unknown carrier, leaving the MNO profile on AUTO\n";
+        return;
+    }
+    // an APN given by the application still wins
+    const char* const apn = m_net_config.apn;
+    m_net_config = *config;
+    if (apn != nullptr) m_net_config.apn = apn;
+    m_info() << "Selected MNO profile " << static_cast<int>(m_net_config.mno) << " from the SIM\n";
+}
+
+const CellularShield::NetworkConfig* CellularShield::find_carrier(const char* const iccid, const char* const imsi) {
+    // ICCIDs are 89 + country code + issuer, IMSIs start with the home MCC + MNC
+    static constexpr CarrierProfile table[] = {
+        { "891480", false, { "vzwinternet", MNOType::VERIZON, PDPType::IPV4, (1UL << 3) | (1UL << 12) } },
+        { "894450", false, { "hologram", MNOType::VERIZON, PDPType::IPV4, 0 } },
+        { "8901410", false, { nullptr, MNOType::ATT, PDPType::IPV4, (1UL << 1) | (1UL << 3) | (1UL << 11) } },
+        { "8901260", false, { nullptr, MNOType::TMOBILE, PDPType::IPV4, (1UL << 1) | (1UL << 3) | (1UL << 11) } },
+        { "311480", true, { "vzwinternet", MNOType::VERIZON, PDPType::IPV4, (1UL << 3) | (1UL << 12) } },
+        { "310410", true, { nullptr, MNOType::ATT, PDPType::IPV4, (1UL << 1) | (1UL << 3) | (1UL << 11) } },
+        { "310260", true, { nullptr, MNOType::TMOBILE, PDPType::IPV4, (1UL << 1) | (1UL << 3) | (1UL << 11) } },
+        { "302220", true, { nullptr, MNOType::TELUS, PDPType::IPV4, 0 } },
+        { "50501", true, { nullptr, MNOType::TELESTRA, PDPType::IPV4, 0 } },
+        { "26201", true, { nullptr, MNOType::DEUTSCHETELECOM, PDPType::IPV4, 0 } },
+        { "23415", true, { nullptr, MNOType::VODAPHONE, PDPType::IPV4, 0 } },
+    };
+    for (uint8_t i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        const char* const id = table[i].imsi ? imsi : iccid;
+        if (id != nullptr && strncmp(id, table[i].prefix, strlen(table[i].prefix)) == 0) return &table[i].config;
+    }
+    return nullptr;
+}
+
+CellularShield::Error CellularShield::m_check_registration() {
+    // network registration check, on EPS like the +CEREG URCs, so the status and the reject cause
+    // come from the same answer: +CEREG: <n>,<stat>[,[<tac>],[<ci>],[<AcT>][,<cause_type>,<reject_cause>]]
+    char res[48] = {};
+    Error err = m_send_command("+CEREG?", true, res, sizeof(res) - 1);
+    if (err != Error::OK) return err;
+    const char* fields[7];
+    uint8_t count = 0;
+    fields[count++] = res;
+    for (const char* c = res; *c != '\0' && count < 7; c++)
+        if (*c == ',') fields[count++] = c + 1;
+    if (count < 2) return Error::INVALID_RESPONSE;
+    m_registration = static_cast<RegistrationStatus>(fields[1][0]);
+    // cause type 0 is an EMM cause, 1 is manufacturer specific
+    m_reject_cause = count == 7 && atoi(fields[5]) == 0 ? atoi(fields[6]) : -1;
+    if (m_power_state == PowerState::SEARCHING || m_power_state == PowerState::IDLE)
+        m_set_power_state(m_network_state());
+    return Error::OK;
+}
+
 CellularShield::Error CellularShield::m_send_command(const char* const command,
     const bool at,
     char* response, 
     const size_t dest_max,
     const unsigned long timeout,
-    const uint8_t tries) const {
-    
-    const auto timeout_calc = timeout ? timeout : m_timeout;
+    const uint8_t tries) {
+
     // check the serial bus for any URCs before transmitting
-    // TODO: write poll function
-    // err = poll();
-    // if (err != Error::OK) return err; 
+    m_poll_urcs();
+    const unsigned long start = LTE_SHIELD_MILLIS();
+    const uint16_t rx_start = m_rx_count;
+    m_cme_error = -1;
+    m_pending = command;
+    const Error err = m_run_command(command, at, response, dest_max, timeout, tries);
+    return m_finish_command(command, err, start, rx_start);
+}
 
+CellularShield::Error CellularShield::m_finish_command(const char* const command,
+    Error err,
+    const unsigned long start,
+    const uint16_t rx_start) {
+
+    m_pending = nullptr;
+    m_stats.commands++;
+    if (err != Error::OK) {
+        m_stats.command_failures++;
+        m_record_error(command, err, start);
+    }
+    // if the modem has gone silent while still indicating power, it is stuck
+    // and we have to power cycle it to get it back
+    if (m_silent_timeouts >= m_policy.stuck_threshold
+        && !m_recovering
+        && digitalRead(m_power_detect_pin) == HIGH) {
+        m_warn() << "Shield stopped responding, attempting recovery...\n";
+        if (m_recover() == Error::OK) err = Error::LTE_RECOVERED;
+    }
+    // journal the command
+    {
+        JournalEntry& entry = m_journal.push();
+        strncpy(entry.command, command, sizeof(entry.command) - 1);
+        entry.command[sizeof(entry.command) - 1] = '\0';
+        entry.result = err;
+        entry.rx_bytes = m_rx_count - rx_start;
+        entry.start = start;
+        const unsigned long duration = LTE_SHIELD_MILLIS() - start;
+        entry.duration = duration > 0xFFFF ? 0xFFFF : duration;
+    }
+    return err;
+}
+
+// unhandled edge cases: command without + prefix
+CellularShield::Error CellularShield::m_run_command(const char* const command,
+    const bool at,
+    char* response, 
+    const size_t dest_max,
+    const unsigned long timeout,
+    const uint8_t tries) {
+    
+    const auto timeout_calc = timeout ? timeout : m_timeout;
     // TODO: modem can turn off after too much idle time. Handle that here?
 
     // if we encouter a timeout error, the device may have just missed the transmission
     // in which case we should keep trying until one goes through
     for (uint8_t try_num = 0; try_num < tries; try_num++) {
+        if (try_num > 0) m_stats.retries++;
         // send the command!
         m_info() << "Try: " << try_num << ", Sending command: AT" << command << '\n';
-        // send the command!
-        if (at) m_serial.print("AT");
-        m_serial.println(command);
-        m_serial.flush();
-        // the datasheet recommends a 20ms delay after sending the command
-        delay(20);
-        const unsigned long start = millis();
-        // skip first line (since it's the echo)
-        {
-            char c;
-            do { c = m_read_serial(start, CellularShield::LTE_SHIELD_ECHO_TIMEOUT); } while (c != '\n' && c != 255);
-            // try again!
-            if (c == 255) {
-                m_warn() << "Device failed to echo!\n";
-                // wait for a minute to let the device settle
-                delay(1000);
-                continue;
-            }
+        const uint16_t rx_start = m_rx_count;
+        // a command that can't be sent won't go any better next try, and the modem isn't to blame
+        const Error write_err = m_write_command(command, at);
+        if (write_err != Error::OK) return write_err;
+        const unsigned long start = LTE_SHIELD_MILLIS();
+        // try again!
+        if (!m_skip_echo(start)) {
+            // wait for a minute to let the device settle
+            LTE_SHIELD_DELAY(1000);
+            continue;
         }
-        // if we're expecting a response, wait until the serial finds something,
-        // and make sure it's what we're looking for
-        if (response != nullptr && dest_max > 0) {
-            // check the response type!
-            const ResponseType resp = m_check_response(start, timeout_calc);
-            if (resp != ResponseType::DATA) {
-                m_error() << "Got unexpected response type from data query: " << static_cast<uint8_t>(resp) << '\n';
-                return m_response_to_error(resp);
-            }
-            // we found a response, so parse it and return the data values
-            // we skip one character in the command string because we have already looked at the '+' character
-            // at the start of the command
-            {
-                uint8_t i = 1;
-                // check that Serial recived data matches the command name
-                for (; i < strnlen(command, LTE_SHIELD_COMMAND_MAX_LEN); i++) {
-                    // the command name is over and we passed
-                    if (command[i] == '=' || command[i] == '?') break;
-                    // read Serial!
-                    const char c = m_read_serial(start, timeout_calc);
-                    if (c == 255) return Error::TIMEOUT;
-                    // check that the command string and returned value are equivilant
-                    if (command[i] != c) {
-                        m_error() << "Command/response mismatch: ";
-                        if (static_cast<uint8_t>(DebugLevel::ERROR) > static_cast<uint8_t>(m_debug)) {
-                            Serial.print(c);
-                            while (m_serial.available()) Serial.print(static_cast<char>(m_serial.read()));
-                            Serial.println();
-                        }
-                        return Error::INVALID_RESPONSE;
-                    }
-                }
-            }
-            // it worked! parse the response into the response buffer
-            // iterate over serial to remove ": " after command name
-            if (m_read_serial(start, timeout_calc) == 255 || m_read_serial(start, timeout_calc) == 255) return Error::TIMEOUT;
-            // write the rest of the serial buffer into the response, until newline or buffer max
-            {
-                size_t i = 0;
-                for (;; i++) {
-                    const char c = m_read_serial(start, timeout_calc);
-                    if (c == 255) return Error::TIMEOUT;
-                    if (c == '\n' || c == '\r') break;
-                    // generate a warning if we hit dest_max
-                    if (i >= dest_max - 1) {
-                        m_warn() << "Response was clipped due to overflowing buffer!\n";
-                        // and flush the buffer
-                        char c = '\0';
-                        while (m_serial.available() && c != '\n') c = m_serial.read();
-                        break;
-                    }
-                    response[i] = c;
-                }
-                response[i] = '\0';
+        const Error err = m_read_response(command, response, dest_max, start, timeout_calc);
+        if (err == Error::LTE_ERROR && m_should_retry(try_num, tries)) continue;
+        // with echo off, a command the modem never heard shows up as a silent timeout instead
+        if (err == Error::TIMEOUT && m_rx_count == rx_start) {
+            m_warn() << "Device did not respond!\n";
+            if (m_silent_timeouts < 255) m_silent_timeouts++;
+            continue;
+        }
+        return err;
+    }
+    m_error() << "Timed out when sending command: AT" << command << '\n';
+    return Error::TIMEOUT;
+}
 
-                m_info() << "Got response: " << response << '\n';
-            }
+CellularShield::Error CellularShield::m_write_command(const char* const command, const bool at) {
+    // anything left over from the last command is stale
+    m_line_end = 0;
+    // frame the command in one buffer so it goes out as a single write
+    char buf[LTE_SHIELD_COMMAND_BUF_LEN];
+    size_t len = 0;
+    if (at) {
+        buf[len++] = 'A';
+        buf[len++] = 'T';
+    }
+    const size_t command_len = strlen(command);
+    if (command_len > sizeof(buf) - len - 1) {
+        m_error() << "Command is too long to send: AT" << command << '\n';
+        return Error::COMMAND_TOO_LONG;
+    }
+    memcpy(buf + len, command, command_len);
+    len += command_len;
+    // commands end with just CR, a trailing LF would be taken as data after a prompt
+    buf[len++] = '\r';
+    m_write(reinterpret_cast<const uint8_t*>(buf), len);
+    m_serial.flush();
+    // the datasheet recommends a 20ms delay after sending the command
+    LTE_SHIELD_DELAY(20);
+    return Error::OK;
+}
+
+void CellularShield::m_write(const uint8_t* const data, const size_t len) {
+    m_serial.write(data, len);
+    m_stats.tx_bytes += len;
+}
+
+bool CellularShield::m_skip_echo(const unsigned long start, const char stop, const char* const stop_prefix) {
+    // with echo off, the next line is already the response
+    if (m_echo == EchoState::OFF) return true;
+    do {
+        const char end = m_read_line(start, CellularShield::LTE_SHIELD_ECHO_TIMEOUT, stop, stop_prefix);
+        if (end == 255) {
+            m_warn() << "Device failed to echo!\n";
+            if (m_silent_timeouts < 255) m_silent_timeouts++;
+            return false;
+        }
+        // found the echo
+        if (m_view.starts_with("AT")) {
+            m_echo = EchoState::ON;
+            return true;
         }
-        // finally, read the ERROR or OK response
-        const ResponseType resp = m_check_response(start, timeout_calc);
-        if (resp != ResponseType::OK) {
-            m_error() << "Got unexpected response type from OK check: " << static_cast<char>(resp) << '\n';
+        if (m_handle_urc()) continue;
+        // if we don't know the echo state, this may be the response itself, so leave
+        // it for the response parser. With echo on it can only be unsolicited.
+        if (m_view.size() != 0 && m_echo == EchoState::UNKNOWN) {
+            m_line_end = end;
+            return true;
+        }
+    } while (true);
+}
+
+CellularShield::Error CellularShield::m_disable_echo(const unsigned long timeout, const uint8_t tries) {
+    // the modem echoes this command if echo was on, which tells us how it started up
+    m_echo = EchoState::UNKNOWN;
+    Error err = m_send_command("E0", true, nullptr, 0, timeout, tries);
+    if (err != Error::OK) return err;
+    const bool echoed = m_echo == EchoState::ON;
+    m_echo = EchoState::OFF;
+    // save the setting to the modem's profile, so it starts with echo off next time
+    if (echoed) {
+        m_info() << "Saving echo off to the modem profile\n";
+        err = m_send_command("&W");
+    }
+    return err;
+}
+
+CellularShield::Error CellularShield::m_read_response(const char* const command,
+    char* response,
+    const size_t dest_max,
+    const unsigned long start,
+    const unsigned long timeout) {
+
+    // if we're expecting a response, wait until the serial finds something,
+    // and make sure it's what we're looking for
+    if (response != nullptr && dest_max > 0) {
+        // check the response type!
+        const ResponseType resp = m_check_response(start, timeout);
+        if (resp != ResponseType::DATA) {
+            m_error() << "Got unexpected response type from data query: " << static_cast<uint8_t>(resp) << '\n';
             return m_response_to_error(resp);
         }
-        m_info() << "Response OK!\n";
-        return Error::OK;
+        // we found a response, check that it belongs to the command and find the data.
+        // some commands (e.g. +CIMI) answer with just the data, and no name to check.
+        const int data = m_view[0] == static_cast<char>(ResponseType::DATA) ? m_match_response(command) : 0;
+        if (data < 0) {
+            m_error() << "Command/response mismatch: " << m_view << '\n';
+            return Error::INVALID_RESPONSE;
+        }
+        // it worked! copy the data into the response buffer, up to buffer max
+        const uint16_t len = m_view.copy(response, dest_max, data);
+        // generate a warning if we hit dest_max
+        if (len > dest_max - 1)
+            m_warn() << "Response was clipped due to overflowing buffer!\n";
+        m_info() << "Got response: " << response << '\n';
     }
-    m_error() << "Timed out when sending command: AT" << command << '\n';
-    return Error::TIMEOUT;
+    // finally, read the ERROR or OK response
+    const ResponseType resp = m_check_response(start, timeout);
+    if (resp != ResponseType::OK) {
+        m_error() << "Got unexpected response type from OK check: " << static_cast<char>(resp) << '\n';
+        return m_response_to_error(resp);
+    }
+    m_info() << "Response OK!\n";
+    return Error::OK;
+}
+
+CellularShield::Error CellularShield::m_wait_prompt(const char prompt, const unsigned long start) {
+    // whole lines before the prompt are the echo, blank lines, URCs, or an error in place of the prompt
+    do {
+        const char end = m_read_line(start, LTE_SHIELD_ECHO_TIMEOUT, prompt);
+        if (end == 255) {
+            m_warn() << "Device did not send the data prompt!\n";
+            return Error::TIMEOUT;
+        }
+        if (end == prompt) return Error::OK;
+        if (m_view.size() != 0 && !m_view.starts_with("AT") && !m_handle_urc()
+            && m_classify_line() == ResponseType::ERROR) return Error::LTE_ERROR;
+    } while (true);
 }
 
-CellularShield::ResponseType CellularShield::m_check_response(const unsigned long start, const unsigned long timeout) const {
+CellularShield::ResponseType CellularShield::m_check_response(const unsigned long start, const unsigned long timeout) {
     // check for the OK or ERROR response
     do {
-        const char c = m_read_serial(start, timeout);
-        if (c == 255) return ResponseType::TIMEOUT;
-        // discard characters that are inbetween commands
-        if (c == '\n' || c == '\r' || c == ' ') continue;
-        // check for a data response
-        if (c == static_cast<char>(ResponseType::DATA)) return ResponseType::DATA;
-        // check for "OK\r\n" response
-        if (c == static_cast<char>(ResponseType::OK)) {
-            // command failed successfully!
-            // flush the serial until we hit the \n
-            char k = 0;
-            do {
-                k = m_read_serial(start, timeout);
-                if (k == 255) return ResponseType::TIMEOUT;
-            } while(k != '\n');
-            // we did it!
-            return ResponseType::OK;
-        }
-        // invalid response!
-        if (c == static_cast<char>(ResponseType::ERROR))
-            m_error() << "LTE shield returned ERROR. Data:";
-        else m_error() << "LTE shield returned an unexpected character. Data:";  
-        // unknown character
-        if (static_cast<uint8_t>(DebugLevel::ERROR) > static_cast<uint8_t>(m_debug)) {
-            Serial.print(c);
-            while (m_serial.available()) Serial.print(static_cast<char>(m_serial.read()));
-            Serial.println();
-        }
-        if (c == 'E') return ResponseType::ERROR;
-        return ResponseType::UNKNOWN;
+        if (m_read_line(start, timeout) == 255) return ResponseType::TIMEOUT;
+        // discard blank lines inbetween commands, and an echo that arrived late
+        if (m_view.size() != 0 && !m_view.starts_with("AT") && !m_handle_urc()) return m_classify_line();
     } while(true);
 }
 
+CellularShield::ResponseType CellularShield::m_classify_line() {
+    // check for "OK\r\n" response
+    if (m_view.equals("OK")) return ResponseType::OK;
+    // check for an error, which may have a numeric code attached if +CMEE=1
+    if (m_view.starts_with("+CME ERROR:") || m_view.starts_with("+CMS ERROR:")) {
+        m_cme_error = m_view.to_int(11);
+        m_error() << "LTE shield returned " << m_view << '\n';
+        return ResponseType::ERROR;
+    }
+    if (m_view.equals("ERROR")) {
+        m_error() << "LTE shield returned ERROR\n";
+        return ResponseType::ERROR;
+    }
+    // check for a data response, with a name or just a number
+    if (m_view[0] == static_cast<char>(ResponseType::DATA) || (m_view[0] >= '0' && m_view[0] <= '9'))
+        return ResponseType::DATA;
+    // invalid response!
+    m_error() << "LTE shield returned an unexpected line: " << m_view << '\n';
+    return ResponseType::UNKNOWN;
+}
+
+bool CellularShield::m_should_retry(const uint8_t try_num, const uint8_t tries) {
+    // only retry errors that are expected to clear on their own
+    const RetryClass retry = get_retry_class(m_cme_error);
+    if (try_num + 1 >= tries
+        || (retry != RetryClass::TRANSIENT && retry != RetryClass::NETWORK)) return false;
+    // back off exponentially, waiting longer on the network than on the modem itself
+    unsigned long wait = retry == RetryClass::NETWORK ? m_policy.retry_network_delay : m_policy.retry_transient_delay;
+    wait <<= try_num;
+    if (wait > m_policy.retry_max_delay) wait = m_policy.retry_max_delay;
+    m_warn() << "Retrying after error " << m_cme_error << " in " << wait << "ms\n";
+    LTE_SHIELD_DELAY(wait);
+    return true;
+}
+
+CellularShield::RetryClass CellularShield::get_retry_class(const int16_t cme_error) {
+    struct Entry {
+        int16_t code;
+        RetryClass retry;
+    };
+    // +CME ERROR codes (3GPP TS 27.007 9.2) and +CMS ERROR codes (TS 27.005 3.2.5),
+    // which do not overlap for the values below
+    static const Entry table[] = {
+        { 3, RetryClass::PERMANENT },     // operation not allowed
+        { 4, RetryClass::PERMANENT },     // operation not supported
+        { 10, RetryClass::PERMANENT },    // SIM not inserted
+        { 11, RetryClass::PERMANENT },    // SIM PIN required
+        { 12, RetryClass::PERMANENT },    // SIM PUK required
+        { 13, RetryClass::PERMANENT },    // SIM failure
+        { 14, RetryClass::TRANSIENT },    // SIM busy
+        { 15, RetryClass::PERMANENT },    // SIM wrong
+        { 16, RetryClass::PERMANENT },    // incorrect password
+        { 30, RetryClass::NETWORK },      // no network service
+        { 31, RetryClass::NETWORK },      // network timeout
+        { 50, RetryClass::PERMANENT },    // incorrect parameters
+        { 100, RetryClass::TRANSIENT },   // unknown
+        { 103, RetryClass::PERMANENT },   // illegal MS
+        { 106, RetryClass::PERMANENT },   // illegal ME
+        { 107, RetryClass::PERMANENT },   // GPRS services not allowed
+        { 111, RetryClass::PERMANENT },   // PLMN not allowed
+        { 112, RetryClass::NETWORK },     // location area not allowed
+        { 113, RetryClass::NETWORK },     // roaming not allowed in this location area
+        { 133, RetryClass::PERMANENT },   // requested service option not subscribed
+        { 134, RetryClass::NETWORK },     // service option temporarily out of order
+        { 148, RetryClass::TRANSIENT },   // unspecified GPRS error
+        { 149, RetryClass::PERMANENT },   // PDP authentication failure
+        { 302, RetryClass::PERMANENT },   // (CMS) operation not allowed
+        { 310, RetryClass::PERMANENT },   // (CMS) SIM not inserted
+        { 314, RetryClass::TRANSIENT },   // (CMS) SIM busy
+        { 330, RetryClass::PERMANENT },   // (CMS) SMSC address unknown
+        { 332, RetryClass::NETWORK },     // (CMS) network timeout
+        { 500, RetryClass::TRANSIENT },   // (CMS) unknown error
+    };
+    for (uint8_t i = 0; i < sizeof(table) / sizeof(table[0]); i++)
+        if (table[i].code == cme_error) return table[i].retry;
+    return RetryClass::NONE;
+}
+
+uint32_t CellularShield::get_reject_backoff(const int16_t cause) {
+    struct Entry {
+        int16_t cause;
+        uint32_t backoff;
+    };
+    // EMM causes from 3GPP TS 24.301 annex A. The timed ones follow the timers the
+    // network would apply, T3402 (12 minutes) being the default.
+    static const Entry table[] = {
+        { 3, 0 },                   // illegal UE
+        { 6, 0 },                   // illegal ME
+        { 7, 0 },                   // EPS services not allowed
+        { 8, 0 },                   // EPS and non-EPS services not allowed
+        { 11, 6UL * 3600000 },      // PLMN not allowed
+        { 12, 12UL * 60000 },       // tracking area not allowed
+        { 13, 12UL * 60000 },       // roaming not allowed in this tracking area
+        { 14, 6UL * 3600000 },      // EPS services not allowed in this PLMN
+        { 15, 12UL * 60000 },       // no suitable cells in tracking area
+        { 17, 60000 },              // network failure
+        { 22, 15UL * 60000 },       // congestion
+        { 42, 12UL * 60000 },       // severe network failure
+    };
+    for (uint8_t i = 0; i < sizeof(table) / sizeof(table[0]); i++)
+        if (table[i].cause == cause) return table[i].backoff;
+    return 12UL * 60000;
+}
+
 CellularShield::Error CellularShield::m_response_to_error(const ResponseType resp) const {
     switch (resp) {
         case ResponseType::OK: return Error::UNEXPECTED_OK;
@@ -414,38 +1145,360 @@ CellularShield::Error CellularShield::m_response_to_error(const ResponseType res
     }
 }
 
- char CellularShield::m_read_serial(const unsigned long start, const unsigned long timeout) const {
-        while (!m_serial.available()) {
-            // wait, checking timeout while we're doing so
-            if (millis() - start > timeout) {
+char CellularShield::m_read_line(const unsigned long start,
+    const unsigned long timeout,
+    const char stop,
+    const char* const stop_prefix) {
+    // a line read ahead by m_skip_echo is returned first
+    if (m_line_end != 0) {
+        const char end = m_line_end;
+        m_line_end = 0;
+        return end;
+    }
+    do {
+        // look for the end of a line ('\n' or the stop character) in what we have so far
+        const uint16_t end = m_find_rx(stop);
+        if (end != m_rx_head) {
+            const char c = m_rx[end & (LTE_SHIELD_RX_BUF_LEN - 1)];
+            if (m_rx_discard) {
+                // still dropping the rest of a line that was too long
+                m_rx_discard = c != '\n';
+                m_rx_tail = m_rx_scan = end + 1;
+                continue;
+            }
+            m_set_view(m_rx_tail, end);
+            // a stop character in any other line (such as a quoted URC field) doesn't end it
+            if (c != '\n' && stop_prefix != nullptr && !m_view.starts_with(stop_prefix)) {
+                m_rx_scan = end + 1;
+                continue;
+            }
+            m_rx_tail = m_rx_scan = end + 1;
+            return c;
+        }
+        m_rx_scan = m_rx_head;
+        // a line that doesn't fit in the ring is cut short, and the rest of it dropped
+        if (static_cast<uint16_t>(m_rx_head - m_rx_tail) == LTE_SHIELD_RX_BUF_LEN) {
+            const bool cut = !m_rx_discard;
+            if (cut) m_set_view(m_rx_tail, m_rx_head);
+            m_rx_tail = m_rx_scan = m_rx_head;
+            m_rx_discard = true;
+            if (cut) return '\n';
+        }
+        // wait for more data, checking timeout while we're doing so
+        if (!m_fill_rx()) {
+            if (LTE_SHIELD_MILLIS() - start > timeout) {
+                m_warn() << "Timed out waiting on the LTE serial\n";
+                m_view = LineView();
+                return 255;
+            }
+            LTE_SHIELD_YIELD();
+        }
+    } while (true);
+}
+
+int CellularShield::m_match_response(const char* const command) const {
+    // we skip one character because we have already looked at the '+' at the start
+    // check that the response name matches the command name
+    uint16_t i = 1;
+    for (; command[i] != '\0' && command[i] != '=' && command[i] != '?'; i++)
+        if (i >= m_view.size() || m_view[i] != command[i]) return -1;
+    // remove ": " after the command name
+    if (i >= m_view.size() || m_view[i] != ':') return -1;
+    if (++i < m_view.size() && m_view[i] == ' ') i++;
+    return i;
+}
+
+bool CellularShield::m_fill_rx() {
+    // move everything the UART has into the ring in one go
+    int count = m_serial.available();
+    if (count <= 0) return false;
+    const uint16_t space = LTE_SHIELD_RX_BUF_LEN - static_cast<uint16_t>(m_rx_head - m_rx_tail);
+    if (count > space) count = space;
+    for (int i = 0; i < count; i++) m_rx[m_rx_head++ & (LTE_SHIELD_RX_BUF_LEN - 1)] = m_serial.read();
+    m_rx_count += count;
+    m_stats.rx_bytes += count;
+    m_silent_timeouts = 0;
+    if (m_rx_head >= LTE_SHIELD_RX_HISTORY_LEN) m_rx_history_full = true;
+    return count > 0;
+}
+
+uint16_t CellularShield::m_find_rx(const char stop) const {
+    // search each contiguous run of the ring with memchr, which checks a word at a time
+    uint16_t pos = m_rx_scan;
+    while (pos != m_rx_head) {
+        const uint16_t index = pos & (LTE_SHIELD_RX_BUF_LEN - 1);
+        uint16_t run = LTE_SHIELD_RX_BUF_LEN - index;
+        if (run > static_cast<uint16_t>(m_rx_head - pos)) run = m_rx_head - pos;
+        const char* const seg = m_rx + index;
+        const char* hit = static_cast<const char*>(memchr(seg, '\n', run));
+        if (stop != '\n') {
+            const char* const hit_stop = static_cast<const char*>(memchr(seg, stop, hit ? hit - seg : run));
+            if (hit_stop != nullptr) hit = hit_stop;
+        }
+        if (hit != nullptr) return pos + (hit - seg);
+        pos += run;
+    }
+    return m_rx_head;
+}
+
+void CellularShield::m_set_view(uint16_t from, uint16_t to) {
+    // drop the '\r's around the line
+    while (from != to && m_rx[from & (LTE_SHIELD_RX_BUF_LEN - 1)] == '\r') from++;
+    while (to != from && m_rx[(to - 1) & (LTE_SHIELD_RX_BUF_LEN - 1)] == '\r') to--;
+    const uint16_t index = from & (LTE_SHIELD_RX_BUF_LEN - 1);
+    const uint16_t len = to - from;
+    const uint16_t first_len = len < LTE_SHIELD_RX_BUF_LEN - index ? len : LTE_SHIELD_RX_BUF_LEN - index;
+    m_view = LineView(m_rx + index, first_len, m_rx, len - first_len);
+}
+
+int CellularShield::LineView::find(const char c, uint16_t from) const {
+    if (from < m_first_len) {
+        const char* const hit = static_cast<const char*>(memchr(m_first + from, c, m_first_len - from));
+        if (hit != nullptr) return hit - m_first;
+        from = m_first_len;
+    }
+    if (from < size()) {
+        const char* const hit = static_cast<const char*>(memchr(m_second + (from - m_first_len), c, size() - from));
+        if (hit != nullptr) return m_first_len + (hit - m_second);
+    }
+    return -1;
+}
+
+long CellularShield::LineView::to_int(uint16_t offset) const {
+    while (offset < size() && (*this)[offset] == ' ') offset++;
+    const bool negative = offset < size() && (*this)[offset] == '-';
+    if (negative) offset++;
+    long value = 0;
+    for (; offset < size() && (*this)[offset] >= '0' && (*this)[offset] <= '9'; offset++)
+        value = value * 10 + ((*this)[offset] - '0');
+    return negative ? -value : value;
+}
+
+uint32_t CellularShield::LineView::prefix_hash() const {
+    uint32_t hash = 2166136261u;
+    for (uint16_t i = 0; i < size() && (*this)[i] != ':'; i++)
+        hash = (hash ^ static_cast<uint8_t>((*this)[i])) * 16777619u;
+    return hash;
+}
+
+uint16_t CellularShield::LineView::copy(char* const dest, const size_t dest_max, const uint16_t offset) const {
+    const uint16_t len = offset < size() ? size() - offset : 0;
+    const size_t count = len < dest_max - 1 ? len : dest_max - 1;
+    for (size_t i = 0; i < count; i++) dest[i] = (*this)[offset + i];
+    dest[count] = '\0';
+    return len;
+}
+
+CellularShield::Error CellularShield::poll() {
+    if (m_ring) m_handle_ring();
+    else m_poll_urcs();
+#if LTE_SHIELD_FEATURE_SOCKETS
+    if (m_boot_phase == BootPhase::READY && m_idle == IdleStrategy::NONE) {
+        if (m_pdp_lost) m_restore_pdp();
+        m_poll_keepalive();
+    }
+#endif
+    if (m_boot_phase == BootPhase::IDLE || m_boot_phase == BootPhase::READY || m_boot_phase == BootPhase::FAILED)
+        return Error::OK;
+    m_boot_step();
+    return m_boot_phase == BootPhase::FAILED ? m_boot_error : Error::OK;
+}
+
+void CellularShield::m_poll_urcs() {
+    // nothing left over belongs to a command any more
+    m_line_end = 0;
+    m_fill_rx();
+    // only take whole lines, anything partial is left for next time
+    while (m_find_rx('\n') != m_rx_head) {
+        m_read_line(LTE_SHIELD_MILLIS(), 0);
+        if (m_view.size() != 0 && !m_handle_urc())
+            m_warn() << "Discarding unexpected line: " << m_view << '\n';
+    }
+}
+
+bool CellularShield::m_handle_urc() {
+    // the response to the command in flight is never unsolicited, even if it shares a name with a URC
+    if (m_view.size() == 0 || m_view[0] != '+'
+        || (m_pending != nullptr && m_match_response(m_pending) >= 0)) return false;
+    // every case checks the name as well, since a line we don't know can still land on a hash
+    switch (m_view.prefix_hash()) {
+        case m_urc_hash("+CREG"):
+        case m_urc_hash("+CEREG"): {
+            // +CREG: <stat>[,...], the first parameter is the status in URCs
+            if (!m_is_urc("+CREG") && !m_is_urc("+CEREG")) return false;
+            const int data = m_match_response(m_is_urc("+CREG") ? "+CREG" : "+CEREG");
+            if (data < static_cast<int>(m_view.size())) {
+                m_registration = static_cast<RegistrationStatus>(m_view[data]);
+                if (m_power_state == PowerState::SEARCHING || m_power_state == PowerState::IDLE)
+                    m_set_power_state(m_network_state());
+                m_info() << "LTE registration changed: " << m_get_reg_dbg_str(m_registration) << '\n';
+            }
+            m_note_urc(WakeCause::REGISTRATION);
+            return true;
+        }
+#if LTE_SHIELD_FEATURE_SOCKETS
+        case m_urc_hash("+UUSORD"):
+        case m_urc_hash("+UUSORF"): {
+            // +UUSORD: <socket>,<length>, data is waiting to be read
+            if (!m_is_urc("+UUSORD") && !m_is_urc("+UUSORF")) return false;
+            const int socket = m_view.to_int(8);
+            const int comma = m_view.find(',', 8);
+            if (socket >= 0 && socket < LTE_SHIELD_MAX_SOCKETS && comma >= 0) {
+                m_sockets[socket].available = m_view.to_int(comma + 1);
+                m_sockets[socket].last_traffic = LTE_SHIELD_MILLIS();
+                m_sockets[socket].probe_answered = true;
+            }
+            m_note_urc(WakeCause::SOCKET_DATA);
+            return true;
+        }
+        case m_urc_hash("+UUSOCL"): {
+            // +UUSOCL: <socket>, closed by the remote end
+            if (!m_is_urc("+UUSOCL")) return false;
+            const int socket = m_view.to_int(8);
+            // unless it is going to be replaced anyway
+            if (socket >= 0 && socket < LTE_SHIELD_MAX_SOCKETS && !m_sockets[socket].lost) {
+                m_sockets[socket].open = false;
+                m_warn() << "Socket " << socket << " was closed by the modem\n";
+            }
+            m_note_urc(WakeCause::SOCKET_CLOSED);
+            return true;
+        }
+        case m_urc_hash("+CGEV"): {
+            // +CGEV: NW DEACT ..., +CGEV: ME PDN DEACT <cid>, +CGEV: NW DETACH, ...
+            if (!m_is_urc("+CGEV")) return false;
+            uint16_t event = m_view.starts_with("NW ", 7) || m_view.starts_with("ME ", 7) ? 10 : 7;
+            if (m_view.starts_with("PDN ", event)) event += 4;
+            if (m_view.starts_with("DEACT", event) || m_view.starts_with("DETACH", event)) m_pdp_deactivated();
+            return true;
+        }
+        case m_urc_hash("+UUPSDD"): {
+            // +UUPSDD: <profile>, the PSD profile was deactivated
+            if (!m_is_urc("+UUPSDD")) return false;
+            m_pdp_deactivated();
+            return true;
+        }
+#endif
+#if LTE_SHIELD_FEATURE_SMS
+        case m_urc_hash("+CMTI"): {
+            // +CMTI: <mem>,<index>
+            if (!m_is_urc("+CMTI")) return false;
+            const int comma = m_view.find(',');
+            if (comma >= 0) m_new_sms = m_view.to_int(comma + 1);
+            m_info() << "New SMS at index " << m_new_sms << '\n';
+            m_note_urc(WakeCause::SMS);
+            return true;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+void CellularShield::m_record_error(const char* const command, const Error err, const unsigned long start) {
+    ErrorRecord& rec = m_errors.push();
+    strncpy(rec.command, command, sizeof(rec.command) - 1);
+    rec.command[sizeof(rec.command) - 1] = '\0';
+    rec.error = err;
+    rec.cme_error = m_cme_error;
+    rec.start = start;
+    rec.end = LTE_SHIELD_MILLIS();
+    // the receive history is whatever came before the head of the ring
+    const uint8_t len = m_rx_history_full ? LTE_SHIELD_RX_HISTORY_LEN : m_rx_head;
+    for (uint8_t i = 0; i < len; i++) rec.rx[i] = m_rx[(m_rx_head - len + i) & (LTE_SHIELD_RX_BUF_LEN - 1)];
+    rec.rx[len] = '\0';
+    rec.rx_len = len;
+}
+
+char CellularShield::m_read_serial(const unsigned long start, const unsigned long timeout) {
+    while (m_rx_head == m_rx_tail) {
+        // wait, checking timeout while we're doing so
+        if (!m_fill_rx()) {
+            if (LTE_SHIELD_MILLIS() - start > timeout) {
                 m_warn() << "Timed out waiting on the LTE serial\n";
                 return 255;
             }
+            LTE_SHIELD_YIELD();
         }
-        // read the first character recieved
-        return m_serial.read();
     }
+    // read the first character recieved
+    const char c = m_rx[m_rx_tail++ & (LTE_SHIELD_RX_BUF_LEN - 1)];
+    if (static_cast<int16_t>(m_rx_scan - m_rx_tail) < 0) m_rx_scan = m_rx_tail;
+    return c;
+}
 
 const char* CellularShield::m_get_pdp_str(const PDPType pdp) {
-    switch(pdp) {
-        case PDPType::IPV4: return "IP";
-        case PDPType::IPV4V6: return "IPV4V6";
-        case PDPType::IPV6: return "IPV6";
-        case PDPType::NONIP: return "NOIP";
-        default: return "IPV4";
-    }
-}
-
-const char* CellularShield::m_get_reg_dbg_str(const RegistrationStatus reg) {
-    switch (reg) {
-        case RegistrationStatus::DENIED: return "DENIED";
-        case RegistrationStatus::DISABLED: return "DISABLED";
-        case RegistrationStatus::HOME_NETWORK: return "HOME NETWORK";
-        case RegistrationStatus::HOME_SMS_ONLY: return "HOME NETWORK (SMS only)";
-        case RegistrationStatus::NO_SIGNAL: return "NO_SIGNAL";
-        case RegistrationStatus::ROAMING: return "ROAMING";
-        case RegistrationStatus::ROAMING_SMS_ONLY: return "ROAMING (SMS only)";
-        case RegistrationStatus::SEARCHING: return "SEARCHING";
-        default: return "ERROR";
-    }
-}
\ No newline at end of file
+    // indexed by PDPType
+    static const char* const names[] = { "IP", "NONIP", "IPV4V6", "IPV6" };
+    const uint8_t i = static_cast<uint8_t>(pdp);
+    return i < sizeof(names) / sizeof(names[0]) ? names[i] : names[0];
+}
+
+CellularShield::DebugName CellularShield::m_get_reg_dbg_str(const RegistrationStatus reg) {
+    const uint8_t code = static_cast<uint8_t>(reg) - static_cast<uint8_t>(RegistrationStatus::DISABLED);
+#if LTE_SHIELD_DEBUG_STRINGS
+    // indexed by RegistrationStatus, starting at '0'
+    static const char* const names[] = {
+        "DISABLED",
+        "HOME NETWORK",
+        "SEARCHING",
+        "DENIED",
+        "NO_SIGNAL",
+        "ROAMING",
+        "HOME NETWORK (SMS only)",
+        "ROAMING (SMS only)",
+    };
+    return { code, code < sizeof(names) / sizeof(names[0]) ? names[code] : "ERROR" };
+#else
+    return { code, nullptr };
+#endif
+}
+
+CellularShield::DebugName CellularShield::get_boot_phase_name(const BootPhase phase) {
+    const uint8_t code = static_cast<uint8_t>(phase);
+#if LTE_SHIELD_DEBUG_STRINGS
+    // indexed by BootPhase
+    static const char* const names[] = {
+        "IDLE",
+        "DETECT",
+        "POWER_PULSE",
+        "POWER_WAIT",
+        "STARTUP",
+        "SIM",
+        "CONFIGURE",
+        "NETWORK",
+        "REGISTER",
+        "READY",
+        "FAILED",
+    };
+    return { code, code < sizeof(names) / sizeof(names[0]) ? names[code] : "UNKNOWN" };
+#else
+    return { code, nullptr };
+#endif
+}
+
+CellularShield::DebugName CellularShield::get_error_name(const Error err) {
+    const uint8_t code = static_cast<uint8_t>(err);
+#if LTE_SHIELD_DEBUG_STRINGS
+    // indexed by Error
+    static const char* const names[] = {
+        "OK",
+        "TIMEOUT",
+        "INVALID_RESPONSE",
+        "UNEXPECTED_DATA",
+        "UNEXPECTED_OK",
+        "LTE_ERROR",
+        "LTE_NOT_FOUND",
+        "LTE_BAD_CONFIG",
+        "LTE_AUTO_MNO_FAILED",
+        "LTE_REGISTRATION_FAILED",
+        "LTE_RECOVERED",
+        "LTE_SOCKET_INVALID",
+        "LTE_SIM_FAILED",
+        "LTE_REGISTRATION_DENIED",
+        "COMMAND_TOO_LONG",
+    };
+    return { code, code < sizeof(names) / sizeof(names[0]) ? names[code] : "UNKNOWN" };
+#else
+    return { code, nullptr };
+#endif
+}
@@ -23,12 +23,96 @@
 #ifndef CellularShieldDriver_H_
 #define CellularShieldDriver_H_
 
+/*
+ * Compile-time feature selection. Each subsystem can be removed from the binary
+ * by defining its flag to 0. A disabled subsystem has its API, state, modem
+ * configuration commands, URC handlers and strings compiled out.
+ *
+ * The flags change the class layout, so the library and the sketch must be built
+ * with the same ones. Set them as global build flags (-DLTE_SHIELD_FEATURE_SMS=0 in
+ * PlatformIO's build_flags, or compiler.cpp.extra_flags in platform.local.txt for
+ * the Arduino IDE), not with a #define in the sketch, which the library's own files
+ * never see. A mismatch fails to link with an undefined lte_shield_features_<S>_<M>_<G>.
+ */
+#ifndef LTE_SHIELD_FEATURE_SOCKETS
+#define LTE_SHIELD_FEATURE_SOCKETS 1
+#endif
+#ifndef LTE_SHIELD_FEATURE_SMS
+#define LTE_SHIELD_FEATURE_SMS 1
+#endif
+#ifndef LTE_SHIELD_FEATURE_GNSS
+#define LTE_SHIELD_FEATURE_GNSS 1
+#endif
+
+// the link check symbol is named after the flags, spelled 0 or 1 however they were set
+#if LTE_SHIELD_FEATURE_SOCKETS
+#define LTE_SHIELD_FEATURE_BIT_SOCKETS 1
+#else
+#define LTE_SHIELD_FEATURE_BIT_SOCKETS 0
+#endif
+#if LTE_SHIELD_FEATURE_SMS
+#define LTE_SHIELD_FEATURE_BIT_SMS 1
+#else
+#define LTE_SHIELD_FEATURE_BIT_SMS 0
+#endif
+#if LTE_SHIELD_FEATURE_GNSS
+#define LTE_SHIELD_FEATURE_BIT_GNSS 1
+#else
+#define LTE_SHIELD_FEATURE_BIT_GNSS 0
+#endif
+#define LTE_SHIELD_FEATURE_CHECK_NAME(s, m, g) lte_shield_features_##s##_##m##_##g
+#define LTE_SHIELD_FEATURE_CHECK_EXPAND(s, m, g) LTE_SHIELD_FEATURE_CHECK_NAME(s, m, g)
+#define LTE_SHIELD_FEATURE_CHECK LTE_SHIELD_FEATURE_CHECK_EXPAND(LTE_SHIELD_FEATURE_BIT_SOCKETS, \
+    LTE_SHIELD_FEATURE_BIT_SMS, LTE_SHIELD_FEATURE_BIT_GNSS)
+
+/** Defined only by the library's build, for the flags it was built with */
+extern const char LTE_SHIELD_FEATURE_CHECK;
+
+/*
+ * Compile-time logging configuration. LTE_SHIELD_LOG_LEVEL is the most verbose
+ * DebugLevel that is compiled in (0 = NONE ... 3 = INFO); messages above it are
+ * removed along with their string literals. Setting LTE_SHIELD_DEBUG_STRINGS to 0
+ * drops the enum name tables, and logs print numeric codes (e.g. "#3") instead.
+ */
+#ifndef LTE_SHIELD_LOG_LEVEL
+#define LTE_SHIELD_LOG_LEVEL 3
+#endif
+#ifndef LTE_SHIELD_DEBUG_STRINGS
+#define LTE_SHIELD_DEBUG_STRINGS 1
+#endif
+
+/*
+ * Time source. Every delay and timeout in the driver goes through these, and every
+ * loop that waits on the modem calls LTE_SHIELD_YIELD() each time around. A host build
+ * can point them at a simulated clock (e.g. -DLTE_SHIELD_MILLIS=sim_millis
+ * -DLTE_SHIELD_DELAY=sim_delay -DLTE_SHIELD_YIELD=sim_yield), where a delay or a wait
+ * skips straight to the next simulated event instead of passing in real time.
+ */
+#ifndef LTE_SHIELD_MILLIS
+#define LTE_SHIELD_MILLIS millis
+#endif
+#ifndef LTE_SHIELD_DELAY
+#define LTE_SHIELD_DELAY delay
+#endif
+#ifndef LTE_SHIELD_YIELD
+#define LTE_SHIELD_YIELD yield
+#endif
+
 class CellularShield {
 public:
 
+    /** Constant mirror of the LTE_SHIELD_FEATURE_* flags, for use in ordinary if statements */
+    struct Features {
+        static constexpr bool SOCKETS = LTE_SHIELD_FEATURE_SOCKETS;
+        static constexpr bool SMS = LTE_SHIELD_FEATURE_SMS;
+        static constexpr bool GNSS = LTE_SHIELD_FEATURE_GNSS;
+    };
+
     static constexpr auto LTE_SHIELD_POWER_PIN = 5;
     static constexpr auto LTE_SHIELD_BAUD = 115200;
     static constexpr auto LTE_SHIELD_COMMAND_MAX_LEN = 10;
+    /** Longest command line that can be sent, including "AT" and the terminator */
+    static constexpr auto LTE_SHIELD_COMMAND_BUF_LEN = 128;
     static constexpr auto LTE_SHIELD_POWER_PULSE_PERIOD = 3200;
     static constexpr auto LTE_SHIELD_RESET_PULSE_PERIOD = 10000;
     static constexpr auto LTE_SHIELD_ECHO_TIMEOUT = 1000;
@@ -36,6 +120,65 @@ public:
     static constexpr auto LTE_SHIELD_RESET_TIMEOUT = 10000;
     static constexpr auto LTE_SHIELD_REGISTER_TIMEOUT = 30000;
     static constexpr auto LTE_SHIELD_GREETING = '@';
+    /** Bump whenever the settings written by m_apply_config change, so existing modems are updated */
+    static constexpr auto LTE_SHIELD_CONFIG_VERSION = 1;
+    /** Size of the receive ring that lines are parsed from, must be a power of two */
+    static constexpr auto LTE_SHIELD_RX_BUF_LEN = 256;
+    static constexpr auto LTE_SHIELD_RX_HISTORY_LEN = 48;
+    static constexpr auto LTE_SHIELD_ERROR_LOG_LEN = 4;
+    static constexpr auto LTE_SHIELD_ERROR_COMMAND_LEN = 24;
+    static constexpr auto LTE_SHIELD_RETRY_TRANSIENT_DELAY = 1000;
+    static constexpr auto LTE_SHIELD_RETRY_NETWORK_DELAY = 3000;
+    static constexpr auto LTE_SHIELD_RETRY_MAX_DELAY = 15000;
+    static constexpr auto LTE_SHIELD_JOURNAL_LEN = 8;
+    static constexpr auto LTE_SHIELD_JOURNAL_COMMAND_LEN = 16;
+    static constexpr auto LTE_SHIELD_RECOVERY_LOG_LEN = 4;
+    static constexpr auto LTE_SHIELD_STUCK_THRESHOLD = 5;
+    static constexpr auto LTE_SHIELD_MAX_SOCKETS = 7;
+    static constexpr auto LTE_SHIELD_SOCKET_TIMEOUT = 30000;
+    /** Largest payload accepted by one +USOWR, and largest hex payload returned by one +USORD */
+    static constexpr auto LTE_SHIELD_SOCKET_WRITE_MAX = 1024;
+    static constexpr auto LTE_SHIELD_SOCKET_READ_MAX = 512;
+    /**
+     * Writes up to this size are sent inline as hex, larger ones raw after the '@' prompt.
+     * Hex costs one extra UART byte per payload byte, while the prompt costs a round trip
+     * plus LTE_SHIELD_PROMPT_DELAY, which is roughly 600 bytes worth of time at 115200 baud.
+     */
+    static constexpr auto LTE_SHIELD_SOCKET_HEX_MAX = 512;
+    static constexpr auto LTE_SHIELD_PROMPT_DELAY = 50;
+    /** Smallest socket transfer the chunk sizing goes down to */
+    static constexpr auto LTE_SHIELD_SOCKET_CHUNK_MIN = 64;
+    /** A socket transfer taking longer than this holds up other commands, so the chunk size is cut */
+    static constexpr auto LTE_SHIELD_SOCKET_CHUNK_LATENCY = 1000;
+    /** Full chunks after a step back before a bigger size is tried again, in case the link improved */
+    static constexpr auto LTE_SHIELD_SOCKET_CHUNK_HOLD = 16;
+    /** Bounds on how often socket_wait_flushed() asks the modem about unacknowledged data */
+    static constexpr auto LTE_SHIELD_FLUSH_POLL_MIN = 100;
+    static constexpr auto LTE_SHIELD_FLUSH_POLL_MAX = 2000;
+    /** First idle time probed for the NAT timeout, and the longest worth finding, in seconds */
+    static constexpr auto LTE_SHIELD_NAT_PROBE_MIN = 30;
+    static constexpr auto LTE_SHIELD_NAT_PROBE_MAX = 3600;
+    /** How long a keepalive ping has to be answered (UDP) or acknowledged (TCP), at least */
+    static constexpr auto LTE_SHIELD_NAT_PROBE_WAIT = 10000;
+    static constexpr auto LTE_SHIELD_POWER_STATE_COUNT = 8;
+    static constexpr uint16_t LTE_SHIELD_CHECKPOINT_MAGIC = 0x4C54;
+    /** How long a busy SIM is given to become ready */
+    static constexpr auto LTE_SHIELD_SIM_TIMEOUT = 5000;
+    static constexpr auto LTE_SHIELD_CCID_LEN = 22;
+    /** Number of checkpointed steps in m_configure_network */
+    static constexpr auto LTE_SHIELD_NETWORK_STEPS = 3;
+    /** Time from switching the modem on until it answers commands, for choose_idle_strategy() */
+    static constexpr auto LTE_SHIELD_BOOT_ESTIMATE = 8000;
+    /** Time registration is assumed to take until it has been measured */
+    static constexpr auto LTE_SHIELD_REGISTER_ESTIMATE = 10000;
+    /** Active time (T3324) requested with PSM, in seconds, the modem stays reachable this long before sleeping */
+    static constexpr auto LTE_SHIELD_PSM_ACTIVE_TIME = 2;
+    /** Time a modem woken from PSM takes to answer commands, for choose_idle_strategy() */
+    static constexpr auto LTE_SHIELD_PSM_WAKE_ESTIMATE = 1500;
+    /** +UGPIOC function that outputs the ring indicator on a modem GPIO */
+    static constexpr auto LTE_SHIELD_GPIO_RING = 18;
+    /** How long to wait for the result that asserted the ring indicator to arrive */
+    static constexpr auto LTE_SHIELD_RING_WAIT = 200;
 
     enum class Protocol {
         TCP = 6,
@@ -60,10 +203,31 @@ public:
         LTE_NOT_FOUND,
         LTE_BAD_CONFIG,
         LTE_AUTO_MNO_FAILED,
-        LTE_REGISTRATION_FAILED
+        LTE_REGISTRATION_FAILED,
+        /** The modem stopped responding and was power cycled, the command was not run */
+        LTE_RECOVERED,
+        LTE_SOCKET_INVALID,
+        /** The SIM is missing, locked or broken */
+        LTE_SIM_FAILED,
+        /** The network rejected the modem, see get_reject_cause() */
+        LTE_REGISTRATION_DENIED,
+        /** The command didn't fit in the command buffer and was never sent */
+        COMMAND_TOO_LONG
     };
 
     
+    /** How a numeric +CME/+CMS ERROR should be handled by the retry logic */
+    enum class RetryClass : uint8_t {
+        /** No (known) error code was given, the command is not retried */
+        NONE,
+        /** The command will never succeed as sent (bad parameters, not allowed, no SIM) */
+        PERMANENT,
+        /** A busy resource that clears within a second or so (e.g. SIM busy) */
+        TRANSIENT,
+        /** Waiting on the network, which can take several seconds */
+        NETWORK
+    };
+
     enum class PDPType {
         IPV4 = 0,
         NONIP = 1,
@@ -109,84 +273,685 @@ public:
         INFO = 3,
     };
 
+    /** Numeric code with an optional name, printed as the name or as "#<code>" if names are compiled out */
+    struct DebugName {
+        const uint8_t code;
+        const char* const name;
+    };
+
     struct NetworkConfig {
+        /** APN for the default PDP context, or nullptr to use the one the network provides */
         const char* apn;
-        const MNOType mno;
-        const PDPType pdp;
+        /** MNO profile. With AUTO, the driver picks a profile from the SIM if it can, see find_carrier() */
+        MNOType mno;
+        PDPType pdp;
+        /** LTE bands 1-32 to use as a bit mask (bit 0 is band 1), or 0 for the MNO profile's defaults */
+        uint32_t bands;
+    };
+
+    /** Maps a SIM to the network config for its carrier, see find_carrier() */
+    struct CarrierProfile {
+        /** Prefix of the ICCID (issuer) or IMSI (home network MCC+MNC) that identifies the carrier */
+        const char* prefix;
+        bool imsi;
+        NetworkConfig config;
     };
 
+    /** Context captured when a command or bring-up step fails, see get_error() */
+    struct ErrorRecord {
+        /** The command being run, without the "AT" prefix (truncated to fit) */
+        char command[LTE_SHIELD_ERROR_COMMAND_LEN];
+        Error error;
+        /** Numeric +CME/+CMS ERROR code reported by the modem, or -1 if none was given */
+        int16_t cme_error;
+        /** LTE_SHIELD_MILLIS() when the command was started and when it failed */
+        unsigned long start;
+        unsigned long end;
+        /** The last bytes received from the modem before the failure, oldest first */
+        char rx[LTE_SHIELD_RX_HISTORY_LEN + 1];
+        uint8_t rx_len;
+    };
+
+    /** One command sent to the modem and its outcome, see get_journal() */
+    struct JournalEntry {
+        /** The command, without the "AT" prefix (truncated to fit) */
+        char command[LTE_SHIELD_JOURNAL_COMMAND_LEN];
+        Error result;
+        /** Number of bytes received from the modem while the command ran */
+        uint16_t rx_bytes;
+        /** LTE_SHIELD_MILLIS() when the command was started, and how long it took (saturating) */
+        unsigned long start;
+        uint16_t duration;
+    };
+
+    /** Escalating steps taken to revive a modem that stopped responding */
+    enum class RecoveryLevel : uint8_t {
+        /** Switch off and on again with the power pin */
+        POWER_CYCLE,
+        /** Hold the power pin for LTE_SHIELD_RESET_PULSE_PERIOD to force a shutdown, then switch on */
+        HARD_RESET
+    };
+
+    /** One recovery attempt, see get_recovery() */
+    struct RecoveryRecord {
+        RecoveryLevel level;
+        /** OK if the modem answered afterwards */
+        Error result;
+        unsigned long start;
+        unsigned long duration;
+    };
+
+    /**
+     * Retry, recovery and network timing behaviour, which can be changed at runtime to compare
+     * policies. The POLICY_ presets below are sized for different radio conditions.
+     */
+    struct Policy {
+        /** First wait before retrying a TRANSIENT or NETWORK error, doubled each try up to retry_max_delay */
+        uint16_t retry_transient_delay;
+        uint16_t retry_network_delay;
+        uint16_t retry_max_delay;
+        /** How long to wait for the modem to register with the network */
+        uint32_t register_timeout;
+        /** How long to wait on socket operations that need a round trip over the network */
+        uint32_t socket_timeout;
+        /** Silent timeouts in a row before the modem is considered stuck and power cycled */
+        uint8_t stuck_threshold;
+    };
+
+    /** Running totals for this instance, see get_stats() */
+    struct Stats {
+        /** Number of calls to begin(), how many failed, and how long the last one took */
+        uint16_t boots;
+        uint16_t boot_failures;
+        unsigned long boot_time;
+        /** Commands sent, how many failed in the end, and how many extra tries they took */
+        uint32_t commands;
+        uint32_t command_failures;
+        uint32_t retries;
+        /** Bytes written to and read from the modem UART */
+        uint32_t tx_bytes;
+        uint32_t rx_bytes;
+        /** Payload bytes written to and read from sockets */
+        uint32_t socket_tx_bytes;
+        uint32_t socket_rx_bytes;
+        /** Times the network took the data context away, and how long it took to get the sockets back the last time */
+        uint16_t pdp_losses;
+        unsigned long reconnect_time;
+    };
+
+    /** What the modem is doing, as far as its current draw is concerned */
+    enum class PowerState : uint8_t {
+        OFF,
+        /** Powered on, but not yet answering commands */
+        BOOTING,
+        /** Looking for or waiting on a network */
+        SEARCHING,
+        /** Registered, and listening for paging between transfers */
+        IDLE,
+        /** Sending or receiving data over the network */
+        ACTIVE,
+        /** Registered, in power saving mode (+CPSMS) */
+        PSM,
+        /** Network radio off (+CFUN=4), with the modem still answering commands */
+        SLEEP,
+        /** Registered, listening for paging only once per extended DRX cycle (+CEDRXS) */
+        EDRX
+    };
+
+    /** How the modem spends the time between reports, see idle() */
+    enum class IdleStrategy : uint8_t {
+        /** Not idling */
+        NONE,
+        /** Switched off, and brought up from scratch to wake */
+        POWER_OFF,
+        /** Radio off (+CFUN=4), registering again to wake */
+        AIRPLANE,
+        /** Power saving mode (+CPSMS), still registered but unreachable while asleep */
+        PSM,
+        /** Extended DRX (+CEDRXS), still registered and reachable once per cycle */
+        EDRX
+    };
+
+    /** Current draw in each PowerState, used to estimate energy, see get_energy() */
+    struct PowerModel {
+        /** Indexed by PowerState, in microamps */
+        uint32_t current[LTE_SHIELD_POWER_STATE_COUNT];
+        uint16_t supply_mv;
+    };
+
+    /** Typical figures for a SARA-R410M on Cat-M1 at 3.8V */
+    static const PowerModel DEFAULT_POWER_MODEL;
+
+    /** Events that assert the ring indicator (+URING), see enable_ring_wake() */
+    enum class RingMode : uint8_t {
+        /** Any unsolicited result */
+        ALL = 1,
+        /** Only incoming socket data (+UUSORD/+UUSORF) */
+        SOCKET_DATA = 2
+    };
+
+    /** The first unsolicited result after a ring, see get_wake_cause() */
+    enum class WakeCause : uint8_t {
+        NONE,
+        /** The ring indicator fired, but no result the driver knows arrived */
+        UNKNOWN,
+        SOCKET_DATA,
+        SOCKET_CLOSED,
+        SMS,
+        REGISTRATION
+    };
+
+    /** Steps of bringing up the modem, see begin_async() */
+    enum class BootPhase : uint8_t {
+        /** begin_async() has not been called */
+        IDLE,
+        /** Checking whether the modem is already on */
+        DETECT,
+        /** Holding the power pin to switch the modem on */
+        POWER_PULSE,
+        /** Waiting for the modem to indicate power */
+        POWER_WAIT,
+        /** Waiting for the modem to answer commands */
+        STARTUP,
+        /** Checking that the SIM is present and unlocked */
+        SIM,
+        /** Checking the settings saved on the modem */
+        CONFIGURE,
+        /** Checking the network settings */
+        NETWORK,
+        /** Waiting for the modem to register with the network */
+        REGISTER,
+        READY,
+        FAILED
+    };
+
+    /**
+     * Progress of begin_async(), kept up to date in memory the application provides. If the
+     * MCU resets part way through and the record survives (e.g. in retained RAM), passing
+     * it to the next begin() resumes without resetting the modem or redoing finished steps.
+     */
+    struct BootCheckpoint {
+        /** LTE_SHIELD_CHECKPOINT_MAGIC if the record is valid */
+        uint16_t magic;
+        /** Hash of the network config and modem settings, a checkpoint from different ones is ignored */
+        uint16_t config_hash;
+        BootPhase phase;
+        /** Steps of the network configuration that are done, and how many times it was started */
+        uint8_t network_step;
+        uint8_t network_attempts;
+    };
+
+    /**
+     * How long the carrier's NAT keeps an idle mapping, as far as keepalives have found out,
+     * see socket_keepalive(). Save it (e.g. in NVM) and restore it with set_nat_timeout()
+     * to skip probing next time.
+     */
+    struct NatTimeout {
+        /** Hash of the APN it was measured on */
+        uint16_t apn_hash;
+        /** Longest idle time a mapping survived, and shortest one it didn't (0 if none), in seconds */
+        uint32_t alive;
+        uint32_t dead;
+    };
+
+    /** Cat-M1 with good coverage, where round trips take a few hundred ms */
+    static const Policy DEFAULT_POLICY;
+    /** Cat-M1 at the cell edge, where coverage enhancement repeats every transmission */
+    static const Policy POLICY_CAT_M1_EDGE;
+    /** NB-IoT, with round trips of several seconds and slow cell search */
+    static const Policy POLICY_NB_IOT;
+
     static const NetworkConfig CONFIG_VERIZON;
-    static const NetworkConfig CONFIG_HOLOGRAM; 
+    static const NetworkConfig CONFIG_HOLOGRAM;
+    /** Let the driver choose the carrier settings from the SIM */
+    static const NetworkConfig CONFIG_AUTO;
 
     CellularShield(HardwareSerial & serial,
         const uint8_t powerDetectPin,
         const uint8_t powerPin = LTE_SHIELD_POWER_PIN,
         const NetworkConfig& netconfig = CONFIG_HOLOGRAM,
         const unsigned int timeout = 5000,
-        const DebugLevel level = DebugLevel::NONE);
+        const DebugLevel level = DebugLevel::NONE)
+        // compiled in the caller, so it links against the feature flags the caller was built with
+        : CellularShield(serial, powerDetectPin, powerPin, netconfig, timeout, level, LTE_SHIELD_FEATURE_CHECK) {}
 
-    bool begin();
+    /**
+     * @brief Bring up the modem, blocking until it is registered or has failed.
+     * See begin_async() for the checkpoint.
+     */
+    bool begin(BootCheckpoint* const checkpoint = nullptr);
+    /**
+     * @brief Start bringing up the modem in the background. Call poll() until get_boot_phase()
+     * is READY or FAILED, and don't use the modem until then. Each poll() blocks for at
+     * most a few seconds, the long waits for power and registration happen between calls.
+     * If checkpoint is given, progress is saved to it, and a valid checkpoint from an
+     * attempt that was interrupted is resumed.
+     */
+    void begin_async(BootCheckpoint* const checkpoint = nullptr);
+    BootPhase get_boot_phase() const { return m_boot_phase; }
+    /** @brief The error that stopped bring-up if get_boot_phase() is FAILED, else OK */
+    Error get_boot_error() const { return m_boot_error; }
 
+    /**
+     * @brief Change the network config. If the modem is already up, it is reconfigured
+     * now if needed, otherwise the config is used by the next begin().
+     */
     bool set_network_config(const NetworkConfig& config);
-    /*
-    int8_t socketOpen(Protocol protocol, unsigned int localPort = 0);
-    LTE_Shield_error_t socketClose(int socket);
-    LTE_Shield_error_t socketConnect(int socket, const char * address, unsigned int port);
-    LTE_Shield_error_t socketWrite(int socket, const char * str);
-    LTE_Shield_error_t socketRead(int socket, int length, char * readDest);
+    const NetworkConfig& get_network_config() const { return m_net_config; }
+    /**
+     * @brief Look up the carrier for a SIM by ICCID, then by IMSI. Either may be nullptr.
+     * Returns nullptr if the carrier isn't known.
+     */
+    static const NetworkConfig* find_carrier(const char* const iccid, const char* const imsi);
+
+#if LTE_SHIELD_FEATURE_SOCKETS
+    /** @brief Open a socket, returning its number or -1 on failure */
+    int8_t socket_open(const Protocol protocol, const unsigned int local_port = 0);
+    /** @brief Connect a socket to a remote host. For UDP this sets the peer for socket_write. */
+    Error socket_connect(const int8_t socket, const char* const address, const unsigned int port);
+    /** @brief Write data to a connected socket, split into as many modem writes as needed */
+    Error socket_write(const int8_t socket, const uint8_t* const data, const size_t len);
+    /** @brief Read up to len bytes that have arrived on a socket, returning the count or -1 on failure */
+    int socket_read(const int8_t socket, uint8_t* const dest, const size_t len);
+    Error socket_close(const int8_t socket);
+    /** @brief Bytes the modem last reported as waiting on a socket (+UUSORD), or -1 if the socket is not open */
+    int socket_available(const int8_t socket) const { return m_socket_valid(socket) ? m_sockets[socket].available : -1; }
+    /** @brief Bytes written to a TCP socket that the peer has not acknowledged yet (+USOCTL), or -1 on failure. 0 for UDP. */
+    int32_t socket_unacked(const int8_t socket);
+    /** @brief Bytes written to a socket since it was opened that the peer has acknowledged, or -1 on failure */
+    int32_t socket_acked(const int8_t socket);
+    /**
+     * @brief Wait until the peer has acknowledged everything written to a socket, or timeout ms
+     * pass, so the modem can be powered down without an application level ack. The modem is
+     * asked less often the longer the remaining data is expected to take.
+     */
+    Error socket_wait_flushed(const int8_t socket, const unsigned long timeout);
+    /** @brief Current size of each +USOWR and +USORD, adapted to the throughput seen so far */
+    uint16_t get_write_chunk() const { return m_write_chunk.size; }
+    uint16_t get_read_chunk() const { return m_read_chunk.size; }
+    /**
+     * @brief Keep a socket's NAT mapping open from poll() by sending ping whenever it has been
+     * idle for get_keepalive_interval(). Until the NAT timeout is known, each ping probes a
+     * longer gap than the last one that survived, after that pings go at 90% of it. A TCP
+     * ping survived if the peer acknowledged it, a UDP ping only if the peer answered it.
+     * With no ping, a TCP socket uses the modem's own keepalive (+USOSO) at the current
+     * interval instead, and nothing is probed.
+     */
+    Error socket_keepalive(const int8_t socket, const uint8_t* const ping, const uint8_t len);
+    const NatTimeout& get_nat_timeout() const { return m_nat; }
+    /** @brief Restore a NAT timeout found earlier. It is ignored if it was for a different APN. */
+    void set_nat_timeout(const NatTimeout& nat) { if (nat.apn_hash == m_apn_hash()) m_nat = nat; }
+    /** @brief Idle time before a keepalive, in seconds, which is the next gap to probe while the NAT timeout isn't known */
+    uint32_t get_keepalive_interval() const;
+    /**
+     * @brief Have poll() reconnect a socket to the peer it was last connected to if the network
+     * deactivates the data context (+CGEV), which kills every socket. The address passed to
+     * socket_connect() must stay valid. Other sockets are closed once the context is back.
+     * Either way, a lost socket fails straight away instead of timing out on the next write.
+     */
+    Error socket_reconnect(const int8_t socket, const bool enable = true);
+    /** @brief If the data context is down, and poll() is working on getting it and the sockets back */
+    bool pdp_lost() const { return m_pdp_lost; }
+#endif
+#if LTE_SHIELD_FEATURE_SMS
+    /** @brief Storage index of the last SMS the modem reported (+CMTI), or -1 if none has arrived */
+    int16_t get_new_sms() const { return m_new_sms; }
+#endif
+    /** @brief Registration status from the last +CREG/+CEREG the modem sent or was asked for */
+    RegistrationStatus get_registration() const { return m_registration; }
+    /** @brief EMM cause (3GPP TS 24.301 annex A) the network gave for denying registration, or -1 */
+    int16_t get_reject_cause() const { return m_reject_cause; }
+    /** @brief ICCID of the SIM read during bring-up, empty if it hasn't been read */
+    const char* get_ccid() const { return m_ccid; }
 
+    /**
+     * @brief Handle any unsolicited result codes the modem has sent, and advance begin_async().
+     * Returns the error that stopped bring-up on the call where it failed, else OK.
+     */
     Error poll();
-    */
+
+    /** @brief Number of error records available (at most LTE_SHIELD_ERROR_LOG_LEN) */
+    uint8_t get_error_count() const { return m_errors.count(); }
+    /** @brief Get a recorded error, 0 being the most recent. Returns nullptr if there is no such record. */
+    const ErrorRecord* get_error(const uint8_t age = 0) const { return m_errors.get(age); }
+
+    /** @brief Number of journaled commands available (at most LTE_SHIELD_JOURNAL_LEN) */
+    uint8_t get_journal_count() const { return m_journal.count(); }
+    /** @brief Get a journaled command, 0 being the most recent. Returns nullptr if there is no such entry. */
+    const JournalEntry* get_journal(const uint8_t age = 0) const { return m_journal.get(age); }
+
+    /** @brief Number of recovery attempts available (at most LTE_SHIELD_RECOVERY_LOG_LEN) */
+    uint8_t get_recovery_count() const { return m_recoveries.count(); }
+    /** @brief Get a recovery attempt, 0 being the most recent. Returns nullptr if there is no such record. */
+    const RecoveryRecord* get_recovery(const uint8_t age = 0) const { return m_recoveries.get(age); }
+
+    void set_policy(const Policy& policy) { m_policy = policy; }
+    const Policy& get_policy() const { return m_policy; }
+    const Stats& get_stats() const { return m_stats; }
+
+    void set_power_model(const PowerModel& model) { m_power_model = model; }
+    PowerState get_power_state() const { return m_power_state; }
+    /** @brief Total time spent in a power state, in ms, including the time in the current state so far */
+    uint64_t get_state_time(const PowerState state) const;
+    /**
+     * @brief Estimated energy used by the modem since it was constructed, in mJ. Take the
+     * difference before and after an operation to get the energy used by that operation.
+     */
+    uint64_t get_energy() const;
+
+    /**
+     * @brief The idle strategy that uses the least energy over one report interval (in ms),
+     * counting both the time asleep and getting back to a registered modem, going by the
+     * power model and how long registration took last time.
+     */
+    IdleStrategy choose_idle_strategy(const uint32_t interval) const;
+    /**
+     * @brief Idle the modem until the next report, interval ms from now, using the cheapest
+     * strategy. If the modem refuses PSM or eDRX, the next cheapest is used instead.
+     * Call wake() before using the modem again.
+     */
+    Error idle(const uint32_t interval);
+    /** @brief Idle the modem using the given strategy, see idle(interval) */
+    Error idle(const uint32_t interval, const IdleStrategy strategy);
+    /** @brief Bring the modem back from idle(), blocking until it is registered again */
+    Error wake();
+    IdleStrategy get_idle_strategy() const { return m_idle; }
+
+    /**
+     * @brief Have the modem pulse its ring indicator on unsolicited results, and listen for
+     * it on an interrupt, so the MCU can sleep until there is something to handle. The
+     * interrupt wakes the MCU, and the next poll() reads the results and sets the wake cause.
+     * @param pin MCU pin wired to the ring indicator
+     * @param gpio If nonzero, the modem GPIO to output the ring indicator on (+UGPIOC),
+     * for boards that don't wire the RI pin itself
+     */
+    Error enable_ring_wake(const uint8_t pin, const RingMode mode = RingMode::ALL, const uint8_t gpio = 0);
+    Error disable_ring_wake();
+    /** @brief If the ring indicator has fired since poll() last handled it */
+    bool ring_pending() const { return m_ring; }
+    /** @brief What the last ring handled by poll() was for, or NONE if there hasn't been one */
+    WakeCause get_wake_cause() const { return m_wake_cause; }
+
+    static DebugName get_error_name(const Error err);
+    static DebugName get_boot_phase_name(const BootPhase phase);
+    /** @brief Classify a numeric +CME/+CMS ERROR code (see ErrorRecord::cme_error) */
+    static RetryClass get_retry_class(const int16_t cme_error);
+    /**
+     * @brief How long to wait before trying to register again after the network denied
+     * registration with an EMM cause (see get_reject_cause()), in ms. 0 means the cause
+     * won't clear without changing the SIM or subscription, so don't retry.
+     */
+    static uint32_t get_reject_backoff(const int16_t cause);
 
 private:
 
+    CellularShield(HardwareSerial & serial,
+        const uint8_t powerDetectPin,
+        const uint8_t powerPin,
+        const NetworkConfig& netconfig,
+        const unsigned int timeout,
+        const DebugLevel level,
+        const char& features);
+
+    /** Fixed size log that overwrites the oldest record when full */
+    template<typename T, uint8_t N>
+    class RecordLog {
+    public:
+        RecordLog() : m_items{}, m_next(0), m_count(0) {}
+        /** @brief Get the slot for a new record */
+        T& push() {
+            T& item = m_items[m_next];
+            m_next = (m_next + 1) % N;
+            if (m_count < N) m_count++;
+            return item;
+        }
+        uint8_t count() const { return m_count; }
+        const T* get(const uint8_t age) const {
+            if (age >= m_count) return nullptr;
+            return &m_items[(m_next + N - 1 - age) % N];
+        }
+    private:
+        T m_items[N];
+        uint8_t m_next;
+        uint8_t m_count;
+    };
+
+    /**
+     * A line in the receive ring, which is one span, or two if it wraps around the end
+     * of the ring. Only valid until the next line or character is read.
+     */
+    class LineView {
+    public:
+        LineView() : m_first(nullptr), m_second(nullptr), m_first_len(0), m_second_len(0) {}
+        LineView(const char* first, const uint16_t first_len, const char* second, const uint16_t second_len)
+            : m_first(first), m_second(second), m_first_len(first_len), m_second_len(second_len) {}
+
+        uint16_t size() const { return m_first_len + m_second_len; }
+        char operator[](const uint16_t i) const { return i < m_first_len ? m_first[i] : m_second[i - m_first_len]; }
+
+        bool starts_with(const char* prefix, const uint16_t offset = 0) const {
+            for (uint16_t i = offset; *prefix != '\0'; i++, prefix++)
+                if (i >= size() || (*this)[i] != *prefix) return false;
+            return true;
+        }
+        bool equals(const char* const str) const { return strlen(str) == size() && starts_with(str); }
+        /** @brief Index of the first c at or after from, or -1 */
+        int find(const char c, uint16_t from = 0) const;
+        /** @brief Parse a decimal number at offset, like atoi */
+        long to_int(uint16_t offset) const;
+        /** @brief Copy from offset into a null terminated string, returning the length before clipping */
+        uint16_t copy(char* const dest, const size_t dest_max, const uint16_t offset = 0) const;
+        /** @brief Hash of the line up to the first ':', the same as m_urc_hash */
+        uint32_t prefix_hash() const;
+        size_t print_to(Print& out) const { return out.write(m_first, m_first_len) + out.write(m_second, m_second_len); }
+    private:
+        const char* m_first;
+        const char* m_second;
+        uint16_t m_first_len;
+        uint16_t m_second_len;
+    };
+
     void m_power_toggle() const;
-    CellularShield::Error m_wait_power_on() const;
+    bool m_wait_power(const bool on, const unsigned long timeout) const;
+    void m_boot_step();
+    void m_boot_set_phase(const BootPhase phase, const unsigned long wait = 0);
+    Error m_boot_finish(const Error err);
+    void m_save_checkpoint() { if (m_checkpoint_store) *m_checkpoint_store = m_checkpoint; }
+    uint16_t m_config_hash() const;
+    void m_set_power_state(const PowerState state);
+    /** @brief IDLE if registered with a network, else SEARCHING */
+    PowerState m_network_state() const;
+    CellularShield::Error m_wait_power_on();
+
+    Error m_recover();
+    Error m_recover_step(const RecoveryLevel level);
 
-    Error m_configure() const;
-    Error m_configure_network() const;
-    Error m_verify_network() const;
+    Error m_configure();
+    Error m_check_config();
+    Error m_apply_config();
+    static void m_get_config_marker(char* const dest, const size_t dest_max);
+    Error m_configure_network();
+    Error m_check_mno();
+    Error m_check_bands();
+    Error m_check_registration();
+    Error m_check_sim();
+    void m_select_carrier();
+    void m_poll_urcs();
+    Error m_wait_registered();
+    /** @brief Charge in uA * ms of idling for interval and then waking, see choose_idle_strategy() */
+    uint64_t m_idle_cost(const IdleStrategy strategy, const uint32_t interval) const;
+    uint64_t m_charge(const PowerState state, const uint32_t time) const {
+        return static_cast<uint64_t>(m_power_model.current[static_cast<uint8_t>(state)]) * time;
+    }
+    /** @brief Requested periodic update timer (T3412) for PSM, the shortest one no sooner than interval */
+    static uint8_t m_periodic_timer(const uint32_t interval);
+    static void m_timer_bits(const uint8_t timer, const uint8_t bits, char* const dest);
+    /** @brief Index of the longest eDRX cycle no longer than interval, or -1 if there is none */
+    static int8_t m_edrx_cycle(const uint32_t interval);
+    static void m_ring_isr() { m_ring = true; }
+    void m_handle_ring();
+    void m_note_urc(const WakeCause cause) { if (m_ring && m_urc_cause == WakeCause::NONE) m_urc_cause = cause; }
 
-    Error m_reset() const;
+    Error m_reset();
 
     Error m_send_command(const char* const command,
         const bool at = true,
         char* response = nullptr, 
         const size_t dest_max = 0,
         const unsigned long timeout = 0,
-        const uint8_t tries = 5) const;
+        const uint8_t tries = 5);
+
+    Error m_run_command(const char* const command,
+        const bool at,
+        char* response, 
+        const size_t dest_max,
+        const unsigned long timeout,
+        const uint8_t tries);
+
+    Error m_finish_command(const char* const command,
+        Error err,
+        const unsigned long start,
+        const uint16_t rx_start);
 
-    ResponseType m_check_response(const unsigned long start, const unsigned long timeout) const;
-    ResponseType m_check_response(const unsigned long start) const { return m_check_response(start, m_timeout); }
+    Error m_write_command(const char* const command, const bool at = true);
+    void m_write(const uint8_t* const data, const size_t len);
+    bool m_skip_echo(const unsigned long start, const char stop = '\n', const char* const stop_prefix = nullptr);
+    Error m_wait_prompt(const char prompt, const unsigned long start);
+    Error m_disable_echo(const unsigned long timeout = 0, const uint8_t tries = 5);
+    Error m_read_response(const char* const command,
+        char* response,
+        const size_t dest_max,
+        const unsigned long start,
+        const unsigned long timeout);
+
+    ResponseType m_check_response(const unsigned long start, const unsigned long timeout);
+    ResponseType m_classify_line();
+    ResponseType m_check_response(const unsigned long start) { return m_check_response(start, m_timeout); }
 
     Error m_response_to_error(const ResponseType resp) const;
 
-    char m_read_serial(const unsigned long start, const unsigned long timeout) const;
-    char m_read_serial(const unsigned long start) const { return m_read_serial(start, m_timeout); }
+    bool m_should_retry(const uint8_t try_num, const uint8_t tries);
+
+    /** @brief Read a line ending in '\n' or stop, where stop only counts on lines starting with stop_prefix (if given) */
+    char m_read_line(const unsigned long start,
+        const unsigned long timeout,
+        const char stop = '\n',
+        const char* const stop_prefix = nullptr);
+    int m_match_response(const char* const command) const;
+    bool m_fill_rx();
+    uint16_t m_find_rx(const char stop) const;
+    void m_set_view(uint16_t from, uint16_t to);
+
+    void m_record_error(const char* const command, const Error err, const unsigned long start);
 
+    /**
+     * @brief FNV-1a hash of a URC name up to the ':'. URCs are dispatched by switching on this,
+     * so two names that collide fail to compile as duplicate case labels.
+     */
+    static constexpr uint32_t m_urc_hash(const char* name, const uint32_t hash = 2166136261u) {
+        return (*name == '\0' || *name == ':') ? hash : m_urc_hash(name + 1, (hash ^ static_cast<uint8_t>(*name)) * 16777619u);
+    }
+    bool m_handle_urc();
+    bool m_is_urc(const char* const name) const { return m_view.starts_with(name) && m_view.starts_with(":", strlen(name)); }
+
+    char m_read_serial(const unsigned long start, const unsigned long timeout);
+    char m_read_serial(const unsigned long start) { return m_read_serial(start, m_timeout); }
+
+    template<bool Enabled, typename = void>
     class SimpleStream {
     public:
         SimpleStream(const bool can_print)
             : m_can_print(can_print) {}
         template<typename T>
         SimpleStream& operator<<(const T& arg) { if (m_can_print) Serial.print(arg); return *this; }
+        SimpleStream& operator<<(const LineView& arg) { if (m_can_print) arg.print_to(Serial); return *this; }
+        SimpleStream& operator<<(const DebugName& arg) {
+            if (!m_can_print) return *this;
+            if (arg.name) Serial.print(arg.name);
+            else { Serial.print('#'); Serial.print(arg.code); }
+            return *this;
+        }
     private:
         bool m_can_print;
     };
 
+    /** @brief Levels above LTE_SHIELD_LOG_LEVEL get this stream, which compiles to nothing */
+    template<typename Dummy>
+    class SimpleStream<false, Dummy> {
+    public:
+        SimpleStream(const bool) {}
+        template<typename T>
+        SimpleStream& operator<<(const T&) { return *this; }
+    };
+
     /** @brief debugging print function, only prints if m_debug is true */
-    SimpleStream m_print(DebugLevel level) const { 
+    template<DebugLevel level>
+    SimpleStream<static_cast<uint8_t>(level) <= LTE_SHIELD_LOG_LEVEL> m_print() const { 
         // check the current debug level and serial status
-        return SimpleStream(static_cast<uint8_t>(level) <= static_cast<uint8_t>(m_debug) 
-            && Serial) << "[CellularShield]";
+        return SimpleStream<static_cast<uint8_t>(level) <= LTE_SHIELD_LOG_LEVEL>(
+            static_cast<uint8_t>(level) <= static_cast<uint8_t>(m_debug) && Serial) << "[CellularShield]";
     }
     /** @brief Prints a info message to serial, if info messages are enabled */
-    SimpleStream m_info() const { return m_print(DebugLevel::INFO) << "[INFO]"; }
-    SimpleStream m_warn() const { return m_print(DebugLevel::WARN) << "[WARN]"; }
-    SimpleStream m_error() const { return m_print(DebugLevel::ERROR) << "[ERROR]"; }
+    SimpleStream<(LTE_SHIELD_LOG_LEVEL >= 3)> m_info() const { return m_print<DebugLevel::INFO>() << "[INFO]"; }
+    SimpleStream<(LTE_SHIELD_LOG_LEVEL >= 2)> m_warn() const { return m_print<DebugLevel::WARN>() << "[WARN]"; }
+    SimpleStream<(LTE_SHIELD_LOG_LEVEL >= 1)> m_error() const { return m_print<DebugLevel::ERROR>() << "[ERROR]"; }
+
+#if LTE_SHIELD_FEATURE_SOCKETS
+    struct SocketState {
+        bool open;
+        Protocol protocol;
+        uint16_t available;
+        /** Bytes written since the socket was opened */
+        uint32_t sent;
+        /** When data last went either way, which is what keeps a NAT mapping open */
+        unsigned long last_traffic;
+        /** Keepalive ping, see socket_keepalive() */
+        const uint8_t* ping;
+        uint8_t ping_len;
+        /** If a ping is waiting on its answer, sent when, after how long idle (in seconds), and if it was answered */
+        bool probing;
+        unsigned long probe_sent;
+        uint32_t probe_idle;
+        bool probe_answered;
+        /** Peer from socket_connect(), and if the socket is reconnected to it, see socket_reconnect() */
+        const char* address;
+        unsigned int port;
+        bool reconnect;
+        /** Waiting to be reconnected after the data context went away */
+        bool lost;
+    };
+
+    /** Size of socket transfers in one direction, adapted by m_chunk_done() */
+    struct ChunkControl {
+        uint16_t size;
+        /** Bytes per second measured at the last full chunk, 0 if not measured */
+        uint32_t rate;
+        /** Full chunks left before growing again after a step back */
+        uint8_t hold;
+    };
+
+    void m_reset_sockets();
+    static void m_chunk_done(ChunkControl& control, const size_t len, const unsigned long time, const bool ok, const uint16_t max);
+    bool m_socket_valid(const int8_t socket) const;
+    Error m_socket_write_chunk(const int8_t socket, const uint8_t* const data, const size_t len);
+    Error m_socket_unacked(const int8_t socket, int32_t& unacked);
+    /** @brief Create a socket on the modem without touching its state here, returning its number or -1 */
+    int8_t m_socket_create(const Protocol protocol, const unsigned int local_port);
+    void m_poll_keepalive();
+    void m_pdp_deactivated();
+    void m_restore_pdp();
+    void m_nat_result(const bool alive, const uint32_t idle);
+    bool m_nat_known() const;
+    /** @brief FNV-1a of the APN, as for URC names */
+    uint16_t m_apn_hash() const {
+        const uint32_t hash = m_urc_hash(m_net_config.apn ? m_net_config.apn : "");
+        return static_cast<uint16_t>(hash ^ (hash >> 16));
+    }
+    static int8_t m_hex_value(const char c);
+#endif
 
     static const char* m_get_pdp_str(const PDPType pdp);
-    static const char* m_get_reg_dbg_str(const RegistrationStatus reg);
+    static DebugName m_get_reg_dbg_str(const RegistrationStatus reg);
 
     HardwareSerial& m_serial;
     NetworkConfig m_net_config;
@@ -194,6 +959,108 @@ private:
     const uint8_t m_power_pin;
     const unsigned int m_timeout;
     const DebugLevel m_debug;
+
+    /** Command echo setting of the modem, which is UNKNOWN until we have turned it off */
+    enum class EchoState : uint8_t {
+        UNKNOWN,
+        ON,
+        OFF
+    };
+
+    /**
+     * Bytes received from the modem. The indices run freely and are masked on access,
+     * everything from tail to head is unread, and the bytes before head are the receive history.
+     */
+    char m_rx[LTE_SHIELD_RX_BUF_LEN];
+    uint16_t m_rx_head;
+    uint16_t m_rx_tail;
+    /** Where the search for the end of the current line continues from */
+    uint16_t m_rx_scan;
+    /** Set after a line too long for the ring was cut short, so the rest of it is dropped */
+    bool m_rx_discard;
+    bool m_rx_history_full;
+    /** The last line read by m_read_line, without the trailing CR/LF */
+    LineView m_view;
+    /** Set to the line terminator if m_view has been read ahead and not yet parsed, else 0 */
+    char m_line_end;
+    EchoState m_echo;
+    /** Numeric code from the last +CME/+CMS ERROR, or -1 */
+    int16_t m_cme_error;
+    /** The command waiting on a response, so its response isn't mistaken for a URC of the same name */
+    const char* m_pending;
+    RegistrationStatus m_registration;
+    int16_t m_reject_cause;
+    char m_ccid[LTE_SHIELD_CCID_LEN];
+
+    /** Total bytes received, and timeouts in a row with no bytes received at all */
+    uint16_t m_rx_count;
+    uint8_t m_silent_timeouts;
+    bool m_recovering;
+
+    Policy m_policy;
+    Stats m_stats;
+
+    BootPhase m_boot_phase;
+    Error m_boot_error;
+    unsigned long m_boot_start;
+    /** When the current phase started, and how long it waits before its next step */
+    unsigned long m_boot_phase_start;
+    unsigned long m_boot_wait;
+    /** If the modem was reset rather than switched on */
+    bool m_boot_reset;
+    /** The phase an interrupted attempt got to, or IDLE if not resuming */
+    BootPhase m_boot_resume;
+    BootCheckpoint m_checkpoint;
+    BootCheckpoint* m_checkpoint_store;
+
+    PowerModel m_power_model;
+    PowerState m_power_state;
+    unsigned long m_power_state_start;
+    /** 64 bits, as a modem that sleeps for months would wrap a millisecond count */
+    uint64_t m_state_time[LTE_SHIELD_POWER_STATE_COUNT];
+
+    IdleStrategy m_idle;
+    /** How long the last registration took */
+    unsigned long m_register_time;
+    /** If the modem refused to enable PSM or eDRX, so they aren't chosen again */
+    bool m_psm_refused;
+    bool m_edrx_refused;
+    /** If the driver is taking the radio down itself (idle(), reconfiguring), so a lost data context is expected */
+    bool m_detaching;
+
+    /** Set from the ring indicator interrupt, there is only one modem */
+    static volatile bool m_ring;
+    /** MCU pin for the ring indicator, or -1 if ring wake is off */
+    int16_t m_ring_pin;
+    WakeCause m_wake_cause;
+    /** The first result handled since the ring indicator fired */
+    WakeCause m_urc_cause;
+
+    RecordLog<ErrorRecord, LTE_SHIELD_ERROR_LOG_LEN> m_errors;
+    RecordLog<JournalEntry, LTE_SHIELD_JOURNAL_LEN> m_journal;
+    RecordLog<RecoveryRecord, LTE_SHIELD_RECOVERY_LOG_LEN> m_recoveries;
+
+#if LTE_SHIELD_FEATURE_SOCKETS
+    SocketState m_sockets[LTE_SHIELD_MAX_SOCKETS];
+    /** If the modem has been switched to hex socket data (+UDCONF=1,1) since it was last reset */
+    bool m_hex_mode;
+    ChunkControl m_write_chunk;
+    ChunkControl m_read_chunk;
+    NatTimeout m_nat;
+    /** If the data context went away and when, and when restoring it was last tried and how long to wait after */
+    bool m_pdp_lost;
+    /** If the loss is counted in the stats, which it isn't when the driver caused it */
+    bool m_pdp_counted;
+    unsigned long m_pdp_lost_at;
+    unsigned long m_pdp_try;
+    unsigned long m_pdp_wait;
+#endif
+#if LTE_SHIELD_FEATURE_SMS
+    int16_t m_new_sms;
+#endif
+
+    static_assert((LTE_SHIELD_RX_BUF_LEN & (LTE_SHIELD_RX_BUF_LEN - 1)) == 0, "RX buffer size must be a power of two");
+    static_assert(LTE_SHIELD_RX_BUF_LEN >= LTE_SHIELD_RX_HISTORY_LEN, "RX buffer must hold the receive history");
 };
 
 #endif
\ No newline at end of file
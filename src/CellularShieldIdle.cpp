@@ -0,0 +1,273 @@
+/* Copyright 2019 OSU OPEnS Lab
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "CellularShieldDriver.h"
+
+// eDRX cycle lengths in ms for LTE Cat-M1, indexed by their code (3GPP TS 24.008 table 10.5.5.32)
+static const uint32_t EDRX_CYCLES[] = {
+    5120, 10240, 20480, 40960, 61440, 81920, 102400, 122880,
+    143360, 163840, 327680, 655360, 1310720, 2621440, 5242880, 10485760
+};
+
+volatile bool CellularShield::m_ring = false;
+
+CellularShield::IdleStrategy CellularShield::choose_idle_strategy(const uint32_t interval) const {
+    static const IdleStrategy options[] = {
+        IdleStrategy::POWER_OFF, IdleStrategy::AIRPLANE, IdleStrategy::PSM, IdleStrategy::EDRX
+    };
+    IdleStrategy best = IdleStrategy::POWER_OFF;
+    uint64_t best_cost = UINT64_MAX;
+    for (const IdleStrategy option : options) {
+        const uint64_t cost = m_idle_cost(option, interval);
+        if (cost < best_cost) {
+            best = option;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+CellularShield::Error CellularShield::idle(const uint32_t interval) {
+    // a refusal rules the strategy out, so choosing again gives the next cheapest
+    IdleStrategy strategy;
+    Error err;
+    do {
+        strategy = choose_idle_strategy(interval);
+        err = idle(interval, strategy);
+    } while (err != Error::OK
+        && ((strategy == IdleStrategy::PSM && m_psm_refused)
+            || (strategy == IdleStrategy::EDRX && m_edrx_refused)));
+    return err;
+}
+
+CellularShield::Error CellularShield::idle(const uint32_t interval, const IdleStrategy strategy) {
+    if (m_idle != IdleStrategy::NONE) {
+        const Error err = wake();
+        if (err != Error::OK) return err;
+    }
+    m_info() << "Idling for " << interval << " ms, strategy " << static_cast<int>(strategy) << '\n';
+    char buf[40];
+    Error err = Error::OK;
+    m_detaching = true;
+    switch (strategy) {
+        case IdleStrategy::POWER_OFF:
+            // the pulse that switches the modem on also switches it off
+            m_power_toggle();
+            if (!m_wait_power(false, LTE_SHIELD_POWER_TIMEOUT)) {
+                m_error() << "Shield did not indicate power off!\n";
+                err = Error::TIMEOUT;
+                break;
+            }
+            m_set_power_state(PowerState::OFF);
+            m_boot_phase = BootPhase::IDLE;
+#if LTE_SHIELD_FEATURE_SOCKETS
+            m_reset_sockets();
+#endif
+            break;
+        case IdleStrategy::AIRPLANE:
+            err = m_send_command("+CFUN=4");
+            if (err == Error::OK) m_set_power_state(PowerState::SLEEP);
+            break;
+        case IdleStrategy::PSM: {
+            // +CPSMS=1,,,<periodic TAU>,<active time>, both timers as bit strings
+            char periodic[9];
+            char active[9];
+            m_timer_bits(m_periodic_timer(interval), 8, periodic);
+            // T3324 in units of 2 seconds
+            m_timer_bits(LTE_SHIELD_PSM_ACTIVE_TIME / 2, 8, active);
+            snprintf(buf, sizeof(buf), "+CPSMS=1,,,\"%s\",\"%s\"", periodic, active);
+            err = m_send_command(buf);
+            if (err == Error::LTE_ERROR) m_psm_refused = true;
+            else if (err == Error::OK) m_set_power_state(PowerState::PSM);
+            break;
+        }
+        case IdleStrategy::EDRX: {
+            const int8_t cycle = m_edrx_cycle(interval);
+            if (cycle < 0) {
+                err = Error::LTE_BAD_CONFIG;
+                break;
+            }
+            // access technology 4 is Cat-M1
+            char bits[5];
+            m_timer_bits(cycle, 4, bits);
+            snprintf(buf, sizeof(buf), "+CEDRXS=1,4,\"%s\"", bits);
+            err = m_send_command(buf);
+            if (err == Error::LTE_ERROR) m_edrx_refused = true;
+            else if (err == Error::OK) m_set_power_state(PowerState::EDRX);
+            break;
+        }
+        default:
+            break;
+    }
+    m_detaching = false;
+    if (err == Error::OK && strategy != IdleStrategy::NONE) m_idle = strategy;
+    return err;
+}
+
+CellularShield::Error CellularShield::wake() {
+    Error err = Error::OK;
+    switch (m_idle) {
+        case IdleStrategy::POWER_OFF:
+            return begin(m_checkpoint_store) ? Error::OK : m_boot_error;
+        case IdleStrategy::AIRPLANE:
+            m_set_power_state(PowerState::SEARCHING);
+            err = m_send_command("+CFUN=1");
+            if (err == Error::OK) err = m_wait_registered();
+            break;
+        case IdleStrategy::PSM:
+            // in deep sleep the modem looks switched off, and a pulse wakes it still registered
+            if (digitalRead(m_power_detect_pin) == LOW) {
+                m_power_toggle();
+                if (!m_wait_power(true, LTE_SHIELD_POWER_TIMEOUT)) {
+                    m_error() << "Shield did not wake from PSM!\n";
+                    return Error::TIMEOUT;
+                }
+                err = m_disable_echo(0, 3);
+                if (err != Error::OK) return err;
+            }
+            // keep the modem awake until the next idle()
+            m_set_power_state(PowerState::SEARCHING);
+            err = m_send_command("+CPSMS=0");
+            if (err == Error::OK) err = m_wait_registered();
+            break;
+        case IdleStrategy::EDRX:
+            err = m_send_command("+CEDRXS=0");
+            m_set_power_state(m_network_state());
+            break;
+        default:
+            return Error::OK;
+    }
+    if (err == Error::OK) m_idle = IdleStrategy::NONE;
+    return err;
+}
+
+CellularShield::Error CellularShield::enable_ring_wake(const uint8_t pin, const RingMode mode, const uint8_t gpio) {
+    char buf[16];
+    Error err;
+    if (gpio != 0) {
+        snprintf(buf, sizeof(buf), "+UGPIOC=%u,%d", gpio, LTE_SHIELD_GPIO_RING);
+        err = m_send_command(buf);
+        if (err != Error::OK) return err;
+    }
+    snprintf(buf, sizeof(buf), "+URING=%d", static_cast<int>(mode));
+    err = m_send_command(buf);
+    if (err != Error::OK) return err;
+    if (m_ring_pin >= 0) detachInterrupt(digitalPinToInterrupt(m_ring_pin));
+    m_ring_pin = pin;
+    m_ring = false;
+    m_urc_cause = WakeCause::NONE;
+    // the line is active low
+    pinMode(pin, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(pin), m_ring_isr, FALLING);
+    return Error::OK;
+}
+
+CellularShield::Error CellularShield::disable_ring_wake() {
+    if (m_ring_pin >= 0) detachInterrupt(digitalPinToInterrupt(m_ring_pin));
+    m_ring_pin = -1;
+    m_ring = false;
+    return m_send_command("+URING=0");
+}
+
+void CellularShield::m_handle_ring() {
+    // the ring comes with the result, but it may still be on its way over the UART
+    const unsigned long start = LTE_SHIELD_MILLIS();
+    do {
+        m_poll_urcs();
+        if (m_urc_cause != WakeCause::NONE) break;
+        LTE_SHIELD_YIELD();
+    } while (LTE_SHIELD_MILLIS() - start < LTE_SHIELD_RING_WAIT);
+    m_wake_cause = m_urc_cause == WakeCause::NONE ? WakeCause::UNKNOWN : m_urc_cause;
+    m_urc_cause = WakeCause::NONE;
+    m_ring = false;
+    m_info() << "Woken by the ring indicator, cause " << static_cast<int>(m_wake_cause) << '\n';
+}
+
+CellularShield::Error CellularShield::m_wait_registered() {
+    const unsigned long start = LTE_SHIELD_MILLIS();
+    while (true) {
+        const Error err = m_check_registration();
+        if (err != Error::OK) return err;
+        if (m_network_state() == PowerState::IDLE) {
+            m_register_time = LTE_SHIELD_MILLIS() - start;
+            return Error::OK;
+        }
+        if (m_registration == RegistrationStatus::DENIED) {
+            m_error() << "LTE registration denied, cause " << m_reject_cause << '\n';
+            return Error::LTE_REGISTRATION_DENIED;
+        }
+        if (LTE_SHIELD_MILLIS() - start >= m_policy.register_timeout) {
+            m_error() << "LTE not registered: " << m_get_reg_dbg_str(m_registration) << '\n';
+            return Error::LTE_REGISTRATION_FAILED;
+        }
+        LTE_SHIELD_DELAY(500);
+    }
+}
+
+uint64_t CellularShield::m_idle_cost(const IdleStrategy strategy, const uint32_t interval) const {
+    switch (strategy) {
+        case IdleStrategy::POWER_OFF:
+            return m_charge(PowerState::OFF, interval)
+                + m_charge(PowerState::BOOTING, LTE_SHIELD_POWER_PULSE_PERIOD + LTE_SHIELD_BOOT_ESTIMATE)
+                + m_charge(PowerState::SEARCHING, m_register_time);
+        case IdleStrategy::AIRPLANE:
+            return m_charge(PowerState::SLEEP, interval) + m_charge(PowerState::SEARCHING, m_register_time);
+        case IdleStrategy::PSM:
+            // the modem stays reachable for the active time before it can sleep, so an interval
+            // no longer than that never gets to PSM at all
+            if (m_psm_refused || interval <= LTE_SHIELD_PSM_ACTIVE_TIME * 1000ul) return UINT64_MAX;
+            return m_charge(PowerState::IDLE, LTE_SHIELD_PSM_ACTIVE_TIME * 1000)
+                + m_charge(PowerState::PSM, interval - LTE_SHIELD_PSM_ACTIVE_TIME * 1000)
+                + m_charge(PowerState::BOOTING, LTE_SHIELD_PSM_WAKE_ESTIMATE);
+        case IdleStrategy::EDRX:
+            if (m_edrx_refused || m_edrx_cycle(interval) < 0) return UINT64_MAX;
+            return m_charge(PowerState::EDRX, interval);
+        default:
+            return UINT64_MAX;
+    }
+}
+
+uint8_t CellularShield::m_periodic_timer(const uint32_t interval) {
+    // GPRS timer 3 (3GPP TS 24.008 10.5.7.4a) is a 3 bit unit then a 5 bit count, the units
+    // here are from shortest to longest. An update before the next report would wake the
+    // modem for nothing, so round up.
+    static const struct { uint32_t seconds; uint8_t unit; } units[] = {
+        { 2, 3 }, { 30, 4 }, { 60, 5 }, { 600, 0 }, { 3600, 1 }, { 36000, 2 }, { 1152000, 6 }
+    };
+    static constexpr uint8_t count = sizeof(units) / sizeof(units[0]);
+    const uint32_t seconds = (interval + 999) / 1000;
+    uint8_t i = 0;
+    while (i + 1 < count && seconds > units[i].seconds * 31) i++;
+    uint32_t value = (seconds + units[i].seconds - 1) / units[i].seconds;
+    if (value > 31) value = 31;
+    return (units[i].unit << 5) | value;
+}
+
+void CellularShield::m_timer_bits(const uint8_t timer, const uint8_t bits, char* const dest) {
+    for (uint8_t i = 0; i < bits; i++) dest[i] = (timer >> (bits - 1 - i)) & 1 ? '1' : '0';
+    dest[bits] = '\0';
+}
+
+int8_t CellularShield::m_edrx_cycle(const uint32_t interval) {
+    int8_t cycle = -1;
+    while (cycle + 1 < static_cast<int8_t>(sizeof(EDRX_CYCLES) / sizeof(EDRX_CYCLES[0]))
+        && EDRX_CYCLES[cycle + 1] <= interval) cycle++;
+    return cycle;
+}
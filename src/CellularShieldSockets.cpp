@@ -0,0 +1,504 @@
+/* Copyright 2019 OSU OPEnS Lab
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "CellularShieldDriver.h"
+
+#if LTE_SHIELD_FEATURE_SOCKETS
+
+int8_t CellularShield::socket_open(const Protocol protocol, const unsigned int local_port) {
+    const int8_t socket = m_socket_create(protocol, local_port);
+    if (socket < 0) return -1;
+    m_sockets[socket].open = true;
+    m_sockets[socket].protocol = protocol;
+    m_sockets[socket].available = 0;
+    m_sockets[socket].sent = 0;
+    m_sockets[socket].last_traffic = LTE_SHIELD_MILLIS();
+    m_sockets[socket].ping = nullptr;
+    m_sockets[socket].probing = false;
+    m_sockets[socket].address = nullptr;
+    m_sockets[socket].reconnect = false;
+    m_sockets[socket].lost = false;
+    m_info() << "Opened socket " << socket << '\n';
+    return socket;
+}
+
+CellularShield::Error CellularShield::socket_connect(const int8_t socket, const char* const address, const unsigned int port) {
+    if (!m_socket_valid(socket)) return Error::LTE_SOCKET_INVALID;
+    char buf[LTE_SHIELD_COMMAND_BUF_LEN];
+    const int len = snprintf(buf, sizeof(buf), "+USOCO=%d,\"%s\",%u", socket, address, port);
+    // a host cut short would connect somewhere else
+    if (len < 0 || static_cast<size_t>(len) >= sizeof(buf)) {
+        m_error() << "Host name is too long: " << address << '\n';
+        return Error::COMMAND_TOO_LONG;
+    }
+    // connecting is a round trip over the network (for TCP)
+    m_set_power_state(PowerState::ACTIVE);
+    const Error err = m_send_command(buf, true, nullptr, 0, m_policy.socket_timeout, 1);
+    m_sockets[socket].last_traffic = LTE_SHIELD_MILLIS();
+    m_sockets[socket].address = address;
+    m_sockets[socket].port = port;
+    m_set_power_state(m_network_state());
+    return err;
+}
+
+CellularShield::Error CellularShield::socket_write(const int8_t socket, const uint8_t* const data, const size_t len) {
+    if (!m_socket_valid(socket)) return Error::LTE_SOCKET_INVALID;
+    m_set_power_state(PowerState::ACTIVE);
+    // the modem limits how much can be sent in one write, so break the data up
+    Error err = Error::OK;
+    for (size_t sent = 0; sent < len;) {
+        size_t chunk = len - sent;
+        if (chunk > m_write_chunk.size) chunk = m_write_chunk.size;
+        const unsigned long start = LTE_SHIELD_MILLIS();
+        err = m_socket_write_chunk(socket, data + sent, chunk);
+        m_chunk_done(m_write_chunk, chunk, LTE_SHIELD_MILLIS() - start, err == Error::OK, LTE_SHIELD_SOCKET_WRITE_MAX);
+        if (err != Error::OK) break;
+        sent += chunk;
+        m_sockets[socket].sent += chunk;
+        m_sockets[socket].last_traffic = LTE_SHIELD_MILLIS();
+        m_stats.socket_tx_bytes += chunk;
+    }
+    m_set_power_state(m_network_state());
+    return err;
+}
+
+int CellularShield::socket_read(const int8_t socket, uint8_t* const dest, const size_t len) {
+    if (!m_socket_valid(socket)) return -1;
+    const size_t want = len > m_read_chunk.size ? m_read_chunk.size : len;
+    char command[20];
+    snprintf(command, sizeof(command), "+USORD=%d,%u", socket, static_cast<unsigned int>(want));
+    const unsigned long start = LTE_SHIELD_MILLIS();
+    const uint16_t rx_start = m_rx_count;
+    m_cme_error = -1;
+    m_pending = command;
+    m_info() << "Sending command: AT" << command << '\n';
+    int got = -1;
+    Error err = m_write_command(command);
+    if (err == Error::OK && !m_skip_echo(start, '"', "+USORD:")) err = Error::TIMEOUT;
+    if (err == Error::OK) {
+        // the response is +USORD: <socket>,<length>,"<hex data>", which can be much longer
+        // than a line buffer, so read up to the quote and then decode the data as it arrives.
+        // URCs with quoted fields can come first, and are read as whole lines.
+        char end;
+        do { end = m_read_line(start, m_timeout, '"', "+USORD:"); } while (end == '\n' && (m_view.size() == 0 || m_handle_urc()));
+        if (end == 255) err = Error::TIMEOUT;
+        else if (end != '"') err = m_response_to_error(m_classify_line());
+        else {
+            const int data = m_match_response(command);
+            const int comma = data < 0 ? -1 : m_view.find(',', data);
+            if (comma < 0) err = Error::INVALID_RESPONSE;
+            else {
+                got = m_view.to_int(comma + 1);
+                if (got < 0) err = Error::INVALID_RESPONSE;
+                for (int i = 0; i < got && err == Error::OK; i++) {
+                    const int8_t hi = m_hex_value(m_read_serial(start));
+                    const int8_t lo = m_hex_value(m_read_serial(start));
+                    if (hi < 0 || lo < 0) err = Error::INVALID_RESPONSE;
+                    else if (static_cast<size_t>(i) < want) dest[i] = (hi << 4) | lo;
+                }
+                // skip the closing quote, then check for OK
+                if (err == Error::OK && m_read_line(start, m_timeout) == 255) err = Error::TIMEOUT;
+                if (err == Error::OK) err = m_read_response(command, nullptr, 0, start, m_timeout);
+                // never report more than fits in dest, the rest was dropped above
+                if (static_cast<size_t>(got) > want) got = want;
+            }
+        }
+    }
+    m_finish_command(command, err, start, rx_start);
+    // a short read only says how much data was waiting, not how the link is doing
+    if (err != Error::OK || static_cast<size_t>(got) == want)
+        m_chunk_done(m_read_chunk, want, LTE_SHIELD_MILLIS() - start, err == Error::OK, LTE_SHIELD_SOCKET_READ_MAX);
+    if (err != Error::OK) return -1;
+    uint16_t& available = m_sockets[socket].available;
+    available = static_cast<uint16_t>(got) < available ? available - got : 0;
+    m_stats.socket_rx_bytes += got;
+    if (got > 0) m_sockets[socket].last_traffic = LTE_SHIELD_MILLIS();
+    m_info() << "Read " << got << " bytes from socket " << socket << '\n';
+    return got;
+}
+
+CellularShield::Error CellularShield::socket_close(const int8_t socket) {
+    // a socket waiting to be reconnected can still be closed
+    if (socket < 0 || socket >= LTE_SHIELD_MAX_SOCKETS || !m_sockets[socket].open) return Error::LTE_SOCKET_INVALID;
+    char buf[12];
+    snprintf(buf, sizeof(buf), "+USOCL=%d", socket);
+    const Error err = m_send_command(buf, true, nullptr, 0, m_policy.socket_timeout);
+    // the socket is gone from our side either way
+    m_sockets[socket].open = false;
+    return err;
+}
+
+int32_t CellularShield::socket_unacked(const int8_t socket) {
+    int32_t unacked;
+    return m_socket_unacked(socket, unacked) == Error::OK ? unacked : -1;
+}
+
+int32_t CellularShield::socket_acked(const int8_t socket) {
+    int32_t unacked;
+    if (m_socket_unacked(socket, unacked) != Error::OK) return -1;
+    const uint32_t sent = m_sockets[socket].sent;
+    return static_cast<uint32_t>(unacked) < sent ? sent - unacked : 0;
+}
+
+CellularShield::Error CellularShield::socket_wait_flushed(const int8_t socket, const unsigned long timeout) {
+    const unsigned long start = LTE_SHIELD_MILLIS();
+    unsigned long interval = LTE_SHIELD_FLUSH_POLL_MIN;
+    int32_t last = -1;
+    unsigned long last_time = start;
+    m_set_power_state(PowerState::ACTIVE);
+    Error err;
+    while (true) {
+        int32_t unacked;
+        err = m_socket_unacked(socket, unacked);
+        if (err != Error::OK || unacked == 0) break;
+        const unsigned long now = LTE_SHIELD_MILLIS();
+        const unsigned long elapsed = now - start;
+        if (elapsed >= timeout) {
+            m_warn() << "Socket " << socket << " still has " << unacked << " bytes unacknowledged\n";
+            err = Error::TIMEOUT;
+            break;
+        }
+        // check back about when the rest should be acknowledged, going by how fast the
+        // last wait drained, or back off if nothing was
+        if (last > unacked) interval = (now - last_time) * unacked / (last - unacked);
+        else if (last >= 0) interval *= 2;
+        if (interval < LTE_SHIELD_FLUSH_POLL_MIN) interval = LTE_SHIELD_FLUSH_POLL_MIN;
+        if (interval > LTE_SHIELD_FLUSH_POLL_MAX) interval = LTE_SHIELD_FLUSH_POLL_MAX;
+        if (interval > timeout - elapsed) interval = timeout - elapsed;
+        last = unacked;
+        last_time = now;
+        LTE_SHIELD_DELAY(interval);
+    }
+    m_set_power_state(m_network_state());
+    return err;
+}
+
+CellularShield::Error CellularShield::socket_keepalive(const int8_t socket, const uint8_t* const ping, const uint8_t len) {
+    if (!m_socket_valid(socket)) return Error::LTE_SOCKET_INVALID;
+    SocketState& state = m_sockets[socket];
+    state.ping = len ? ping : nullptr;
+    state.ping_len = len;
+    state.probing = false;
+    if (state.ping != nullptr) return Error::OK;
+    if (state.protocol != Protocol::TCP) return Error::LTE_BAD_CONFIG;
+    // SO_KEEPALIVE, then TCP_KEEPIDLE in ms
+    char buf[40];
+    snprintf(buf, sizeof(buf), "+USOSO=%d,65535,8,1", socket);
+    const Error err = m_send_command(buf);
+    if (err != Error::OK) return err;
+    snprintf(buf, sizeof(buf), "+USOSO=%d,6,2,%lu", socket, static_cast<unsigned long>(get_keepalive_interval()) * 1000ul);
+    return m_send_command(buf);
+}
+
+uint32_t CellularShield::get_keepalive_interval() const {
+    const bool same_apn = m_nat.apn_hash == m_apn_hash();
+    const uint32_t alive = same_apn ? m_nat.alive : 0;
+    const uint32_t dead = same_apn ? m_nat.dead : 0;
+    if (m_nat_known()) return alive - alive / 10;
+    // double the gap until a mapping is dropped, then bisect between the two
+    if (dead == 0) {
+        if (alive == 0) return LTE_SHIELD_NAT_PROBE_MIN;
+        return alive * 2 < LTE_SHIELD_NAT_PROBE_MAX ? alive * 2 : LTE_SHIELD_NAT_PROBE_MAX;
+    }
+    return alive + dead > 1 ? (alive + dead) / 2 : 1;
+}
+
+void CellularShield::m_poll_keepalive() {
+    for (int8_t i = 0; i < LTE_SHIELD_MAX_SOCKETS; i++) {
+        SocketState& state = m_sockets[i];
+        if (!state.open || state.lost || state.ping == nullptr) continue;
+        const unsigned long now = LTE_SHIELD_MILLIS();
+        if (state.probing) {
+            // UDP needs an answer from the peer, TCP only an acknowledgement
+            if (state.protocol == Protocol::UDP && state.probe_answered) {
+                state.probing = false;
+                m_nat_result(true, state.probe_idle);
+            }
+            // a slow network (NB-IoT, the cell edge) can take longer than the usual wait to answer
+            else if (now - state.probe_sent >= (m_policy.socket_timeout > LTE_SHIELD_NAT_PROBE_WAIT
+                ? m_policy.socket_timeout : static_cast<uint32_t>(LTE_SHIELD_NAT_PROBE_WAIT))) {
+                // an unanswered UDP ping was dropped, while a failed TCP query says nothing, so ask again next time
+                int32_t unacked = -1;
+                if (state.protocol == Protocol::TCP && m_socket_unacked(i, unacked) != Error::OK) continue;
+                state.probing = false;
+                m_nat_result(unacked == 0, state.probe_idle);
+                // a TCP connection doesn't survive losing its mapping, and later pings would only queue up behind it
+                if (state.protocol == Protocol::TCP && unacked != 0) state.ping = nullptr;
+            }
+        }
+        else if (now - state.last_traffic >= get_keepalive_interval() * 1000ul) {
+            state.probe_idle = (now - state.last_traffic) / 1000;
+            state.probe_answered = false;
+            if (socket_write(i, state.ping, state.ping_len) == Error::OK) {
+                state.probing = true;
+                state.probe_sent = LTE_SHIELD_MILLIS();
+            }
+        }
+    }
+}
+
+void CellularShield::m_nat_result(const bool alive, const uint32_t idle) {
+    const uint16_t hash = m_apn_hash();
+    if (m_nat.apn_hash != hash) m_nat = { hash, 0, 0 };
+    const NatTimeout last = m_nat;
+    if (alive) {
+        if (idle > m_nat.alive) m_nat.alive = idle;
+        // the NAT changed its mind, so the old bound is no use
+        if (m_nat.dead != 0 && m_nat.dead <= m_nat.alive) m_nat.dead = 0;
+    }
+    else {
+        if (m_nat.dead == 0 || idle < m_nat.dead) m_nat.dead = idle;
+        if (m_nat.alive >= m_nat.dead) m_nat.alive = 0;
+        m_warn() << "NAT mapping was dropped after " << idle << " s idle\n";
+    }
+    if (m_nat.alive != last.alive || m_nat.dead != last.dead)
+        m_info() << "NAT timeout between " << m_nat.alive << " and " << m_nat.dead << " s\n";
+}
+
+bool CellularShield::m_nat_known() const {
+    if (m_nat.apn_hash != m_apn_hash()) return false;
+    // close enough once the bounds are within an eighth of each other
+    return m_nat.alive >= LTE_SHIELD_NAT_PROBE_MAX
+        || (m_nat.dead != 0 && m_nat.alive != 0 && m_nat.dead - m_nat.alive <= m_nat.alive / 8);
+}
+
+CellularShield::Error CellularShield::socket_reconnect(const int8_t socket, const bool enable) {
+    if (!m_socket_valid(socket)) return Error::LTE_SOCKET_INVALID;
+    if (enable && m_sockets[socket].address == nullptr) return Error::LTE_BAD_CONFIG;
+    m_sockets[socket].reconnect = enable;
+    return Error::OK;
+}
+
+void CellularShield::m_pdp_deactivated() {
+    // contexts come and go while the modem starts up, bring-up takes care of those
+    if (m_boot_phase != BootPhase::READY) return;
+    if (!m_pdp_lost) {
+        m_pdp_lost = true;
+        m_pdp_lost_at = LTE_SHIELD_MILLIS();
+        // idling or reconfiguring takes the context down on purpose, which isn't a loss,
+        // but the sockets still have to be replaced once the modem is back
+        m_pdp_counted = !m_detaching && m_idle == IdleStrategy::NONE;
+        if (m_pdp_counted) {
+            m_warn() << "Data context was deactivated\n";
+            m_stats.pdp_losses++;
+        }
+    }
+    m_pdp_wait = 0;
+    // every socket died with it, writes fail straight away until poll() replaces or closes them
+    for (uint8_t i = 0; i < LTE_SHIELD_MAX_SOCKETS; i++) m_sockets[i].lost = true;
+}
+
+void CellularShield::m_restore_pdp() {
+    if (LTE_SHIELD_MILLIS() - m_pdp_try < m_pdp_wait) return;
+    Error err = m_send_command("+CGACT=1,1", true, nullptr, 0, m_policy.socket_timeout, 1);
+    // close every dead socket first, the ones to reconnect stay lost on our side
+    char buf[12];
+    for (int8_t i = 0; i < LTE_SHIELD_MAX_SOCKETS && err == Error::OK; i++) {
+        if (!m_sockets[i].open || !m_sockets[i].lost) continue;
+        snprintf(buf, sizeof(buf), "+USOCL=%d", i);
+        m_send_command(buf, true, nullptr, 0, m_policy.socket_timeout, 1);
+        if (!m_sockets[i].reconnect) m_sockets[i].open = false;
+    }
+    // then replace the rest in order. The modem hands out the lowest free number, and the
+    // application only knows the old one, so lower numbers are held until it comes up.
+    uint8_t held = 0;
+    for (int8_t i = 0; i < LTE_SHIELD_MAX_SOCKETS && err == Error::OK; i++) {
+        SocketState& state = m_sockets[i];
+        if (!state.open || !state.lost) continue;
+        int8_t socket;
+        do {
+            socket = m_socket_create(state.protocol, 0);
+            if (socket >= 0 && socket < i) held |= 1 << socket;
+        } while (socket >= 0 && socket < i);
+        if (socket != i) {
+            if (socket > i) {
+                // something else took the number, give this one back and try again later
+                m_error() << "Socket " << i << " came back as " << socket << '\n';
+                snprintf(buf, sizeof(buf), "+USOCL=%d", socket);
+                m_send_command(buf, true, nullptr, 0, m_policy.socket_timeout, 1);
+            }
+            err = Error::LTE_ERROR;
+            break;
+        }
+        state.available = 0;
+        state.sent = 0;
+        state.probing = false;
+        state.lost = false;
+        err = socket_connect(i, state.address, state.port);
+        state.lost = err != Error::OK;
+    }
+    for (int8_t i = 0; i < LTE_SHIELD_MAX_SOCKETS; i++) {
+        if (!(held & (1 << i))) continue;
+        snprintf(buf, sizeof(buf), "+USOCL=%d", i);
+        m_send_command(buf, true, nullptr, 0, m_policy.socket_timeout, 1);
+    }
+    // a context event during all this loses the sockets again
+    bool lost = false;
+    for (uint8_t i = 0; i < LTE_SHIELD_MAX_SOCKETS; i++) lost = lost || (m_sockets[i].open && m_sockets[i].lost);
+    if (err != Error::OK || lost) {
+        // back off like a retried command
+        m_pdp_try = LTE_SHIELD_MILLIS();
+        m_pdp_wait = m_pdp_wait == 0 ? m_policy.retry_network_delay : m_pdp_wait * 2;
+        if (m_pdp_wait > m_policy.retry_max_delay) m_pdp_wait = m_policy.retry_max_delay;
+        return;
+    }
+    m_pdp_lost = false;
+    const unsigned long time = LTE_SHIELD_MILLIS() - m_pdp_lost_at;
+    if (m_pdp_counted) m_stats.reconnect_time = time;
+    m_info() << "Data context and sockets restored in " << time << " ms\n";
+}
+
+void CellularShield::m_reset_sockets() {
+    // resetting the modem closes every socket and clears the data format
+    for (uint8_t i = 0; i < LTE_SHIELD_MAX_SOCKETS; i++) m_sockets[i].open = false;
+    m_hex_mode = false;
+}
+
+void CellularShield::m_chunk_done(ChunkControl& control, const size_t len, const unsigned long time, const bool ok, const uint16_t max) {
+    // a failed or slow transfer ties up the command channel, so back off whatever the throughput
+    if (!ok || time > LTE_SHIELD_SOCKET_CHUNK_LATENCY) {
+        control.size = control.size / 2 > LTE_SHIELD_SOCKET_CHUNK_MIN ? control.size / 2 : LTE_SHIELD_SOCKET_CHUNK_MIN;
+        control.hold = LTE_SHIELD_SOCKET_CHUNK_HOLD;
+        return;
+    }
+    // only a full chunk says anything about its size
+    if (len != control.size) return;
+    const uint32_t rate = len * 1000 / (time ? time : 1);
+    // keep growing while bigger chunks are faster, and step back for a while if the last step
+    // made it much slower
+    if (control.hold > 0) control.hold--;
+    else if (rate > control.rate && control.size < max)
+        control.size = control.size * 2 < max ? control.size * 2 : max;
+    else if (rate < control.rate - control.rate / 4 && control.size > LTE_SHIELD_SOCKET_CHUNK_MIN) {
+        control.size /= 2;
+        control.hold = LTE_SHIELD_SOCKET_CHUNK_HOLD;
+    }
+    control.rate = rate;
+}
+
+bool CellularShield::m_socket_valid(const int8_t socket) const {
+    return socket >= 0 && socket < LTE_SHIELD_MAX_SOCKETS && m_sockets[socket].open && !m_sockets[socket].lost;
+}
+
+CellularShield::Error CellularShield::m_socket_write_chunk(const int8_t socket, const uint8_t* const data, const size_t len) {
+    // small payloads go inline as hex, avoiding the wait for the prompt, larger ones
+    // are sent raw after the prompt, which is half the bytes on the UART
+    const bool binary = len > LTE_SHIELD_SOCKET_HEX_MAX;
+    char command[20];
+    snprintf(command, sizeof(command), "+USOWR=%d,%u", socket, static_cast<unsigned int>(len));
+    const unsigned long start = LTE_SHIELD_MILLIS();
+    const uint16_t rx_start = m_rx_count;
+    m_cme_error = -1;
+    m_pending = command;
+    m_info() << "Writing " << len << (binary ? " bytes raw" : " bytes as hex") << " to socket " << socket << '\n';
+    Error err;
+    if (binary) {
+        // AT+USOWR=<socket>,<length>, wait for '@', then the data
+        err = m_write_command(command);
+        if (err == Error::OK) err = m_wait_prompt(LTE_SHIELD_GREETING, start);
+        if (err == Error::OK) {
+            // the modem needs a moment after the prompt before it accepts data
+            LTE_SHIELD_DELAY(LTE_SHIELD_PROMPT_DELAY);
+            m_write(data, len);
+            m_serial.flush();
+        }
+    }
+    else {
+        // AT+USOWR=<socket>,<length>,"<hex data>", framed in as few writes as the buffer allows
+        static const char hex[] = "0123456789ABCDEF";
+        m_line_end = 0;
+        char buf[LTE_SHIELD_COMMAND_BUF_LEN];
+        size_t pos = snprintf(buf, sizeof(buf), "AT%s,\"", command);
+        for (size_t i = 0; i < len; i++) {
+            if (pos + 2 > sizeof(buf)) {
+                m_write(reinterpret_cast<const uint8_t*>(buf), pos);
+                pos = 0;
+            }
+            buf[pos++] = hex[data[i] >> 4];
+            buf[pos++] = hex[data[i] & 0xF];
+        }
+        if (pos + 2 > sizeof(buf)) {
+            m_write(reinterpret_cast<const uint8_t*>(buf), pos);
+            pos = 0;
+        }
+        buf[pos++] = '"';
+        buf[pos++] = '\r';
+        m_write(reinterpret_cast<const uint8_t*>(buf), pos);
+        m_serial.flush();
+        LTE_SHIELD_DELAY(20);
+        err = m_skip_echo(start) ? Error::OK : Error::TIMEOUT;
+    }
+    if (err == Error::OK) {
+        // the modem answers with +USOWR: <socket>,<length written>
+        char res[12] = {};
+        err = m_read_response(command, res, sizeof(res), start, m_timeout);
+        const char* comma = strchr(res, ',');
+        if (err == Error::OK && (comma == nullptr || static_cast<size_t>(atoi(comma + 1)) != len)) {
+            m_error() << "Modem did not accept all socket data: " << res << '\n';
+            err = Error::INVALID_RESPONSE;
+        }
+    }
+    return m_finish_command(command, err, start, rx_start);
+}
+
+CellularShield::Error CellularShield::m_socket_unacked(const int8_t socket, int32_t& unacked) {
+    if (!m_socket_valid(socket)) return Error::LTE_SOCKET_INVALID;
+    // UDP has no acknowledgements, whatever was written is gone
+    unacked = 0;
+    if (m_sockets[socket].protocol != Protocol::TCP) return Error::OK;
+    char command[16];
+    snprintf(command, sizeof(command), "+USOCTL=%d,11", socket);
+    // +USOCTL: <socket>,11,<bytes>
+    char res[24] = {};
+    const Error err = m_send_command(command, true, res, sizeof(res));
+    if (err != Error::OK) return err;
+    const char* const value = strrchr(res, ',');
+    if (value == nullptr) return Error::INVALID_RESPONSE;
+    unacked = atol(value + 1);
+    return Error::OK;
+}
+
+int8_t CellularShield::m_socket_create(const Protocol protocol, const unsigned int local_port) {
+    // socket data is exchanged as hex, so binary payloads can't break up the response lines
+    if (!m_hex_mode) {
+        if (m_send_command("+UDCONF=1,1") != Error::OK) return -1;
+        m_hex_mode = true;
+    }
+    char buf[20];
+    if (local_port) snprintf(buf, sizeof(buf), "+USOCR=%d,%u", static_cast<int>(protocol), local_port);
+    else snprintf(buf, sizeof(buf), "+USOCR=%d", static_cast<int>(protocol));
+    char res[4] = {};
+    if (m_send_command(buf, true, res, sizeof(res)) != Error::OK) return -1;
+    const int socket = atoi(res);
+    if (socket < 0 || socket >= LTE_SHIELD_MAX_SOCKETS) {
+        m_error() << "Modem returned an invalid socket: " << res << '\n';
+        return -1;
+    }
+    return socket;
+}
+
+int8_t CellularShield::m_hex_value(const char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+#endif